@@ -0,0 +1,438 @@
+/*
+ * Benchmark the UEFI block devices from the initrd.
+ *
+ * The kernel is built without AIO or io_uring, so the queue depth
+ * is made with one thread per outstanding request, each doing
+ * synchronous O_DIRECT reads or writes.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <getopt.h>
+
+static int verbose;
+
+typedef struct {
+	const char * name;
+	int is_write;
+	int is_random;
+} pattern_t;
+
+static const pattern_t patterns[] = {
+	{ "seqread",	0, 0 },
+	{ "randread",	0, 1 },
+	{ "seqwrite",	1, 0 },
+	{ "randwrite",	1, 1 },
+};
+
+#define NUM_PATTERNS (sizeof(patterns) / sizeof(*patterns))
+
+// shared by all of the threads for one run
+typedef struct {
+	int fd;
+	const pattern_t * pattern;
+	size_t block_size;
+	uint64_t dev_size;
+	uint64_t max_bytes;
+	volatile int stop;
+	uint64_t next_offset; // for sequential runs
+	uint64_t bytes; // total done, for the max_bytes limit
+} run_t;
+
+typedef struct {
+	pthread_t thread;
+	run_t * run;
+	unsigned id;
+	uint64_t ios;
+	uint64_t errors;
+	uint32_t * latency; // microseconds
+	size_t latency_count;
+	size_t latency_max;
+} worker_t;
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t * state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static int latency_add(worker_t * w, uint32_t us)
+{
+	if (w->latency_count == w->latency_max)
+	{
+		size_t new_max = w->latency_max ? 2 * w->latency_max : 65536;
+		uint32_t * new_latency = realloc(w->latency, new_max * sizeof(*new_latency));
+		if (!new_latency)
+			return -1;
+		w->latency = new_latency;
+		w->latency_max = new_max;
+	}
+
+	w->latency[w->latency_count++] = us;
+	return 0;
+}
+
+static void * worker_thread(void * arg)
+{
+	worker_t * const w = arg;
+	run_t * const run = w->run;
+	const uint64_t blocks = run->dev_size / run->block_size;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL * (w->id + 1);
+	uint8_t * buf;
+
+	if (posix_memalign((void**) &buf, 4096, run->block_size) != 0)
+		return NULL;
+
+	// something that isn't zeros, so that nothing can optimize it away
+	for(size_t i = 0 ; i < run->block_size ; i++)
+		buf[i] = i * 0x3b + w->id;
+
+	while (!run->stop)
+	{
+		uint64_t offset;
+
+		if (run->pattern->is_random)
+			offset = (xorshift64(&seed) % blocks) * run->block_size;
+		else
+			offset = __atomic_fetch_add(&run->next_offset, run->block_size, __ATOMIC_RELAXED)
+				% (blocks * run->block_size);
+
+		if (run->max_bytes
+		&&  __atomic_fetch_add(&run->bytes, run->block_size, __ATOMIC_RELAXED) >= run->max_bytes)
+			break;
+
+		const uint64_t start = now_ns();
+		const ssize_t rc = run->pattern->is_write
+			? pwrite(run->fd, buf, run->block_size, offset)
+			: pread(run->fd, buf, run->block_size, offset);
+		const uint64_t end = now_ns();
+
+		if (rc != (ssize_t) run->block_size)
+		{
+			if (w->errors++ == 0)
+				fprintf(stderr, "%s @ %"PRIu64": %s\n",
+					run->pattern->name, offset,
+					rc < 0 ? strerror(errno) : "short transfer");
+			continue;
+		}
+
+		w->ios++;
+		if (latency_add(w, (end - start) / 1000) < 0)
+			break;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int compare_u32(const void * a, const void * b)
+{
+	const uint32_t x = *(const uint32_t*) a;
+	const uint32_t y = *(const uint32_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t * sorted, size_t count, double p)
+{
+	if (count == 0)
+		return 0;
+	size_t i = (size_t)(p * (count - 1) / 100.0 + 0.5);
+	return sorted[i];
+}
+
+static int run_pattern(
+	int fd,
+	const pattern_t * pattern,
+	uint64_t dev_size,
+	size_t block_size,
+	unsigned queue_depth,
+	unsigned seconds,
+	uint64_t max_bytes
+)
+{
+	run_t run = {
+		.fd		= fd,
+		.pattern	= pattern,
+		.block_size	= block_size,
+		.dev_size	= dev_size,
+		.max_bytes	= max_bytes,
+	};
+	worker_t * workers = calloc(queue_depth, sizeof(*workers));
+	uint64_t ios = 0;
+	uint64_t errors = 0;
+	size_t latency_count = 0;
+
+	if (!workers)
+		return -1;
+
+	const uint64_t start = now_ns();
+
+	for(unsigned i = 0 ; i < queue_depth ; i++)
+	{
+		workers[i].run = &run;
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0)
+		{
+			perror("pthread_create");
+			run.stop = 1;
+			queue_depth = i;
+			break;
+		}
+	}
+
+	// run for the time limit, or until the threads hit the byte limit
+	if (max_bytes == 0)
+	{
+		sleep(seconds);
+		run.stop = 1;
+	}
+
+	for(unsigned i = 0 ; i < queue_depth ; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		ios += workers[i].ios;
+		errors += workers[i].errors;
+		latency_count += workers[i].latency_count;
+	}
+
+	const double elapsed = (now_ns() - start) / 1.0e9;
+
+	// merge all of the latencies to find the percentiles
+	uint32_t * latency = malloc((latency_count + 1) * sizeof(*latency));
+	size_t offset = 0;
+	for(unsigned i = 0 ; i < queue_depth ; i++)
+	{
+		if (latency)
+			memcpy(latency + offset, workers[i].latency,
+				workers[i].latency_count * sizeof(*latency));
+		offset += workers[i].latency_count;
+		free(workers[i].latency);
+	}
+	free(workers);
+
+	if (!latency)
+		return -1;
+
+	qsort(latency, latency_count, sizeof(*latency), compare_u32);
+
+	printf("%-10s bs=%-7zu qd=%-3u %9.2f MB/s %9.0f IOPS"
+		" lat us p50=%u p90=%u p99=%u p99.9=%u max=%u%s\n",
+		pattern->name,
+		block_size,
+		queue_depth,
+		ios * block_size / elapsed / 1.0e6,
+		ios / elapsed,
+		percentile(latency, latency_count, 50),
+		percentile(latency, latency_count, 90),
+		percentile(latency, latency_count, 99),
+		percentile(latency, latency_count, 99.9),
+		latency_count ? latency[latency_count - 1] : 0,
+		errors ? " ERRORS" : ""
+	);
+
+	if (verbose)
+		printf("%-10s %"PRIu64" ios %"PRIu64" errors in %.3f seconds\n",
+			pattern->name, ios, errors, elapsed);
+
+	free(latency);
+	return errors ? -1 : 0;
+}
+
+
+static const char usage[] =
+"Usage: uefi-bench [options] /dev/uefiN\n"
+"\n"
+"Options:\n"
+"-h | --help                This help\n"
+"-v | --verbose             Print more details\n"
+"-p | --pattern name        seqread, randread, seqwrite, randwrite or all\n"
+"-b | --block-size 4096     Size of each request in bytes\n"
+"-q | --queue-depth 1       Number of requests outstanding\n"
+"-t | --time 5              Seconds to run each pattern\n"
+"-n | --bytes 0             Bytes to transfer instead of a time limit\n"
+"-s | --size 0              Only use the first part of the device\n"
+"-w | --write               Allow the write patterns, destroying the data\n"
+"\n"
+"The default is to run all of the read patterns.  Block sizes\n"
+"must be a multiple of the logical block size of the device.\n"
+"\n"
+"";
+
+static const struct option options[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "verbose", no_argument, 0, 'v' },
+	{ "pattern", required_argument, 0, 'p' },
+	{ "block-size", required_argument, 0, 'b' },
+	{ "queue-depth", required_argument, 0, 'q' },
+	{ "time", required_argument, 0, 't' },
+	{ "bytes", required_argument, 0, 'n' },
+	{ "size", required_argument, 0, 's' },
+	{ "write", no_argument, 0, 'w' },
+	{ 0, 0, 0, 0},
+};
+
+
+int main(int argc, char ** argv)
+{
+	const char * pattern_str = "all";
+	size_t block_size = 4096;
+	unsigned queue_depth = 1;
+	unsigned seconds = 5;
+	uint64_t max_bytes = 0;
+	uint64_t max_size = 0;
+	int allow_write = 0;
+	int status = EXIT_SUCCESS;
+
+	opterr = 1;
+	optind = 1;
+
+	while (1)
+	{
+		const int opt = getopt_long(argc, argv, "h?vp:b:q:t:n:s:w", options, 0);
+		if (opt < 0)
+			break;
+
+		switch(opt) {
+		case 'p':
+			pattern_str = optarg;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			queue_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			max_bytes = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			max_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			allow_write = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_FAILURE;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind < 1)
+	{
+		fprintf(stderr, "Missing block device to benchmark!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (block_size == 0 || queue_depth == 0)
+	{
+		fprintf(stderr, "Block size and queue depth must be non-zero\n");
+		return EXIT_FAILURE;
+	}
+
+	const char * dev_file = argv[optind];
+	const int fd = open(dev_file, (allow_write ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0)
+	{
+		perror(dev_file);
+		return EXIT_FAILURE;
+	}
+
+	uint64_t dev_size = 0;
+	int sector_size = 512;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+	{
+		perror(dev_file);
+		return EXIT_FAILURE;
+	}
+
+	if (S_ISBLK(st.st_mode))
+	{
+		if (ioctl(fd, BLKGETSIZE64, &dev_size) < 0
+		||  ioctl(fd, BLKSSZGET, &sector_size) < 0)
+		{
+			perror(dev_file);
+			return EXIT_FAILURE;
+		}
+	} else {
+		dev_size = st.st_size;
+	}
+
+	if (max_size && max_size < dev_size)
+		dev_size = max_size;
+
+	if (block_size % sector_size != 0 || dev_size < block_size)
+	{
+		fprintf(stderr, "%s: block size %zu does not fit sector size %d and size %"PRIu64"\n",
+			dev_file, block_size, sector_size, dev_size);
+		return EXIT_FAILURE;
+	}
+
+	if (verbose)
+		printf("%s: %"PRIu64" bytes, %d byte sectors\n",
+			dev_file, dev_size, sector_size);
+
+	int ran = 0;
+	for(unsigned i = 0 ; i < NUM_PATTERNS ; i++)
+	{
+		const pattern_t * pattern = &patterns[i];
+		const int all = strcmp(pattern_str, "all") == 0;
+
+		if (!all && strcmp(pattern_str, pattern->name) != 0)
+			continue;
+
+		if (pattern->is_write && !allow_write)
+		{
+			if (!all)
+				fprintf(stderr, "%s: needs --write to run %s\n",
+					dev_file, pattern->name);
+			continue;
+		}
+
+		ran++;
+		if (run_pattern(fd, pattern, dev_size, block_size, queue_depth, seconds, max_bytes) < 0)
+			status = EXIT_FAILURE;
+	}
+
+	if (ran == 0)
+	{
+		fprintf(stderr, "%s: no patterns run\n", pattern_str);
+		status = EXIT_FAILURE;
+	}
+
+	close(fd);
+	return status;
+}
@@ -247,7 +247,7 @@ int main(int argc, char ** argv)
 	if (filesystem_str)
 	{
 		char dev_str[256];
-		snprintf(dev_str, sizeof(dev_str), "/sys/devices/virtual/block/%s/uefi_handle", filesystem_str);
+		snprintf(dev_str, sizeof(dev_str), "/sys/class/block/%s/uefi_handle", filesystem_str);
 		FILE * f = fopen(dev_str, "r");
 		if (!f)
 		{
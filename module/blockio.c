@@ -10,233 +10,1802 @@
 #include <linux/io.h>
 #include <linux/blkdev.h>
 #include <linux/blk-mq.h>
+#include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/hashtable.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
+#include <linux/sizes.h>
+#include <linux/backing-dev.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+#include <linux/sysfs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#ifdef CONFIG_UEFIBLOCK_DAX
+#include <linux/dax.h>
+#include <linux/memremap.h>
+#include <linux/pfn_t.h>
+#include <linux/uio.h>
+#endif
 #include "efiwrapper.h"
 #include "blockio.h"
+#include "ramdisk.h"
 
 static int debug = 0;
 static int major;
 
+// whole disks are partitioned by Linux
+#define UEFI_BLOCKDEV_MINORS 16
 
+static int partition_disks = 0;
+module_param(partition_disks, int, 0444);
+MODULE_PARM_DESC(partition_disks, "Create a separate disk for every UEFI partition handle");
+
+static int xfer_kb = 128;
+module_param(xfer_kb, int, 0444);
+MODULE_PARM_DESC(xfer_kb, "Size of the per-device transfer buffer and largest request in KiB");
+
+static int readahead_kb = 0;
+module_param(readahead_kb, int, 0444);
+MODULE_PARM_DESC(readahead_kb, "Readahead in KiB, 0 for twice the transfer size");
+
+static int bounce_buffers = 4;
+module_param(bounce_buffers, int, 0444);
+MODULE_PARM_DESC(bounce_buffers, "Number of transfer buffers per device");
+
+static int subblock = 1;
+module_param(subblock, int, 0444);
+MODULE_PARM_DESC(subblock, "Use 512 byte sectors on large block media");
+
+static int blockio2 = 1;
+module_param(blockio2, int, 0444);
+MODULE_PARM_DESC(blockio2, "Use asynchronous EFI_BLOCK_IO2_PROTOCOL when available");
+
+static int cache_kb = 512;
+module_param(cache_kb, int, 0444);
+MODULE_PARM_DESC(cache_kb, "Size of the per-device read cache in KiB, 0 to disable");
+
+static int poll_us = 20;
+module_param(poll_us, int, 0644);
+MODULE_PARM_DESC(poll_us, "Delay between polls of in-flight BlockIo2 requests");
+
+static int hw_queues = 0;
+module_param(hw_queues, int, 0444);
+MODULE_PARM_DESC(hw_queues, "Number of blk-mq hardware queues per device, 0 for one per CPU");
+
+static int queue_depth = 64;
+module_param(queue_depth, int, 0444);
+MODULE_PARM_DESC(queue_depth, "Maximum requests outstanding per hardware queue");
+
+static int sweep_ms = 1000;
+module_param(sweep_ms, int, 0644);
+MODULE_PARM_DESC(sweep_ms, "How often to check for removed UEFI block handles, 0 to disable");
+
+
+// log2 histogram of firmware call times in microseconds,
+// the last bucket is everything over about 4 seconds.
+#define UEFI_BLOCKDEV_LATENCY_BUCKETS 24
+
+// firmware disk performance counters, only updated by the worker
+typedef struct {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long flushes;
+	unsigned long segments;
+	unsigned long read_bytes;
+	unsigned long write_bytes;
+	unsigned long firmware_calls;
+	unsigned long bounces;
+	unsigned long partials; // requests that were not whole blocks
+	unsigned long errors;
+	unsigned long read_latency[UEFI_BLOCKDEV_LATENCY_BUCKETS];
+	unsigned long write_latency[UEFI_BLOCKDEV_LATENCY_BUCKETS];
+} uefi_blockdev_stats_t;
+
+// Devices that are separate disks over the same sectors, like a
+// partition handle that couldn't be matched and its whole disk,
+// share a count of the writes to any of them.  Each one drops its
+// read cache when another has written since it last looked.  Only
+// the worker thread touches the count.
+typedef struct {
+	struct kref kref;
+	unsigned long writes;
+} uefi_blockdev_group_t;
+
+// UEFI partition handles that have been matched to a Linux partition
 typedef struct {
+	EFI_HANDLE uefi_handle;
+	char * devicepath_string;
+} uefi_blockdev_part_t;
+
+typedef struct {
+	struct list_head list;
+	int index; // uefiN
 	spinlock_t lock;
 	struct gendisk *gd;
 	struct request_queue *queue;
 	struct blk_mq_tag_set tag_set;
 	atomic_t refcnt;
 
-	EFI_HANDLE uefi_handle;
-	EFI_BLOCK_IO_PROTOCOL *uefi_bio;
-	uint8_t * buffer;
+	EFI_HANDLE uefi_handle;
+	EFI_BLOCK_IO_PROTOCOL *uefi_bio;
+	EFI_BLOCK_IO2_PROTOCOL *uefi_bio2; // NULL if not present
+	EFI_DISK_IO_PROTOCOL *uefi_diskio; // NULL if not present
+
+	// the media that Linux thinks is in the drive; the firmware
+	// will refuse I/O with EFI_MEDIA_CHANGED if it is a different
+	// one, and nothing is sent to it until the disk is revalidated.
+	size_t block_size;
+	UINT32 media_id;
+	bool media_present;
+	bool media_changed;
+	bool removable;
+
+	// set when the handle has gone away, after which nothing is
+	// sent to the firmware for this disk
+	bool dead;
+
+	// RAM disks are accessed directly rather than via the firmware
+	uint8_t * ramdisk;
+	size_t ramdisk_size;
+	bool ramdisk_ro;
+
+#ifdef CONFIG_UEFIBLOCK_DAX
+	phys_addr_t ramdisk_phys;
+	struct dev_pagemap pgmap;
+	struct dax_device * dax_dev;
+#endif
+
+	// pool of bounce buffers for requests that are scattered in
+	// memory or misaligned, each a multiple of the block size.
+	// the first one is reserved for the synchronous path.
+	uint8_t * bounce[BITS_PER_LONG];
+	unsigned long bounce_free; // bitmap
+	unsigned bounce_count;
+	unsigned bounce_order;
+	uint8_t * buffer; // == bounce[0]
+	size_t buffer_size;
+	size_t io_align;
+
+	// LRU cache of recently read blocks, keyed by LBA.
+	// only used by the worker thread.
+	DECLARE_HASHTABLE(cache_hash, 10);
+	struct list_head cache_lru;
+	unsigned cache_count;
+	unsigned cache_max;
+	unsigned long cache_gen; // incremented on every write
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	UINT32 cache_media_id; // the cache is dropped when this changes
+	uefi_blockdev_group_t * group; // NULL if nothing else aliases it
+	unsigned long group_writes;
+
+	uefi_blockdev_stats_t stats;
+	struct dentry * debugfs;
+
+	const EFI_DEVICE_PATH_PROTOCOL * devicepath;
+	size_t devicepath_len;
+	char devicepath_string[256];
+
+	uefi_blockdev_part_t parts[UEFI_BLOCKDEV_MINORS];
+} uefi_blockdev_t;
+
+static LIST_HEAD(uefi_blockdev_list);
+
+// Every UEFI BlockIo handle that has been seen, hashed by the handle.
+// Whole disks point to their device, partitions that were matched to
+// a Linux partition point to the parent disk and partition number,
+// and those that could not be added have neither.
+typedef struct {
+	struct hlist_node hash;
+	EFI_HANDLE handle;
+	EFI_BLOCK_IO_PROTOCOL * uefi_bio;
+	uefi_blockdev_t * dev;
+	uefi_blockdev_t * parent;
+	unsigned partno;
+} uefi_blockdev_handle_t;
+
+// the handle registry and device list are only touched with the mutex
+static DEFINE_HASHTABLE(uefi_blockdev_handles, 8);
+static DEFINE_MUTEX(uefi_blockdev_mutex);
+static DEFINE_IDA(uefi_blockdev_ida);
+static void * uefi_blockdev_registration;
+static bool uefi_blockdev_scanned;
+
+typedef struct {
+	struct hlist_node hash;
+	struct list_head lru;
+	EFI_LBA lba;
+	uint8_t data[];
+} uefi_blockdev_cache_t;
+
+// per-request data, allocated by blk-mq alongside the request
+typedef struct {
+	struct list_head list;
+
+	// BlockIo2 requests in flight
+	EFI_BLOCK_IO2_TOKEN token;
+	uint8_t * buffer; // bounce buffer, or NULL if direct
+	int bounce;
+
+	// cache generation when a read was started
+	unsigned long cache_gen;
+
+	// when the BlockIo2 request was handed to the firmware
+	u64 start_ns;
+} uefi_blockdev_cmd_t;
+
+// per hardware queue list of requests for the worker.  queues that
+// have requests waiting are on the ready list, and the worker takes
+// one request at a time from the front queue and then moves it to
+// the back, so that a busy disk doesn't starve the others.
+typedef struct {
+	struct list_head ready;
+	struct list_head pending;
+} uefi_blockdev_hwq_t;
+
+static LIST_HEAD(uefi_blockdev_ready);
+static LIST_HEAD(uefi_blockdev_inflight); // only used by the worker
+static DEFINE_SPINLOCK(uefi_blockdev_pending_lock);
+static DECLARE_WAIT_QUEUE_HEAD(uefi_blockdev_wait);
+static struct task_struct * uefi_blockdev_thread;
+
+
+// Account for a firmware read or write that was started at start_ns
+static void uefi_blockdev_latency(uefi_blockdev_t * dev, bool is_write, u64 start_ns)
+{
+	const u64 us = (ktime_get_ns() - start_ns) / NSEC_PER_USEC;
+	const unsigned bucket = us == 0 ? 0
+		: min_t(unsigned, ilog2(us) + 1, UEFI_BLOCKDEV_LATENCY_BUCKETS - 1);
+
+	if (is_write)
+		dev->stats.write_latency[bucket]++;
+	else
+		dev->stats.read_latency[bucket]++;
+}
+
+// EFI_NO_MEDIA and EFI_MEDIA_CHANGED mean that our MediaId is stale
+// and nothing will work until the disk has been revalidated.
+static bool uefi_blockdev_media_error(uefi_blockdev_t * dev, int status)
+{
+	if (status != 12 && status != 13)
+		return false;
+
+	if (!dev->media_changed)
+		printk("%s: media %s\n", dev->gd->disk_name, status == 12 ? "removed" : "changed");
+
+	dev->media_changed = true;
+	return true;
+}
+
+// Complete a request that went to the firmware
+static void uefi_blockdev_end(uefi_blockdev_t * dev, struct request * rq, int status)
+{
+	if (status)
+		dev->stats.errors++;
+
+	if (uefi_blockdev_media_error(dev, status))
+	{
+		blk_mq_end_request(rq, BLK_STS_MEDIUM);
+		return;
+	}
+
+	blk_mq_end_request(rq, status ? BLK_STS_IOERR : BLK_STS_OK);
+}
+
+// Issue a single firmware call for a run of whole blocks
+static int uefi_blockdev_xfer(uefi_blockdev_t * dev, bool is_write, EFI_LBA lba, size_t len, void * buf)
+{
+	unsigned long flags;
+	u64 start_ns;
+	int status;
+
+	if (debug)
+	printk("%s.%d: %s %08llx + %08zx <=> %016llx\n",
+		dev->gd->disk_name,
+		dev->media_id,
+		is_write ? "WRITE" : "READ ",
+		lba,
+		len,
+		(uint64_t) buf
+	);
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
+
+	start_ns = ktime_get_ns();
+	if (is_write)
+		status = uefi_call_timeout("WriteBlocks", uefi_watchdog_timeout(len), dev->uefi_bio->WriteBlocks,
+			dev->uefi_bio,
+			dev->media_id,
+			lba,
+			len,
+			buf
+		);
+	else
+		status = uefi_call_timeout("ReadBlocks", uefi_watchdog_timeout(len), dev->uefi_bio->ReadBlocks,
+			dev->uefi_bio,
+			dev->media_id,
+			lba,
+			len,
+			buf
+		);
+
+	uefi_firmware_exit(flags);
+
+	dev->stats.firmware_calls++;
+	uefi_blockdev_latency(dev, is_write, start_ns);
+
+	return status;
+}
+
+// If every segment of the request follows the previous one in
+// memory, and the start is aligned the way the firmware wants,
+// then it can transfer straight into the pages.
+// Returns NULL if the request needs to be staged.
+static void * uefi_blockdev_contiguous(uefi_blockdev_t * dev, struct request * rq)
+{
+	struct bio_vec bvec;
+	struct req_iterator iter;
+	uint8_t * start = NULL;
+	uint8_t * end = NULL;
+
+	rq_for_each_segment(bvec, rq, iter) {
+		uint8_t * addr = page_address(bvec.bv_page) + bvec.bv_offset;
+
+		if (!start)
+			start = addr;
+		else
+		if (addr != end)
+			return NULL;
+
+		end = addr + bvec.bv_len;
+	}
+
+	if (!IS_ALIGNED((uintptr_t) start, dev->io_align))
+		return NULL;
+
+	return start;
+}
+
+// Take a bounce buffer for an asynchronous request, returns -1 if
+// they are all in use.  Only the worker thread uses the pool.
+static int uefi_blockdev_bounce_get(uefi_blockdev_t * dev)
+{
+	const unsigned i = find_next_bit(&dev->bounce_free, dev->bounce_count, 1);
+
+	if (i >= dev->bounce_count)
+		return -1;
+
+	__clear_bit(i, &dev->bounce_free);
+	return i;
+}
+
+static void uefi_blockdev_bounce_put(uefi_blockdev_t * dev, int i)
+{
+	if (i > 0)
+		__set_bit(i, &dev->bounce_free);
+}
+
+// The buffers are allocated as whole pages, which are naturally
+// aligned to their size and so satisfy any sane IoAlign.  If the
+// transfer size is more than the page allocator can provide, it is
+// halved (in whole blocks) until the first buffer can be had.
+static int uefi_blockdev_bounce_alloc(uefi_blockdev_t * dev)
+{
+	const size_t min_size = roundup(PAGE_SIZE, dev->block_size);
+
+	dev->bounce_count = clamp(bounce_buffers, 1, BITS_PER_LONG);
+	dev->bounce_free = 0;
+
+	while (1)
+	{
+		dev->bounce_order = get_order(dev->buffer_size);
+		if (dev->bounce_order < MAX_ORDER)
+			dev->bounce[0] = (void*) __get_free_pages(GFP_KERNEL | __GFP_NOWARN, dev->bounce_order);
+		if (dev->bounce[0])
+			break;
+
+		if (dev->buffer_size <= min_size)
+		{
+			dev->bounce_count = 0;
+			return -1;
+		}
+
+		dev->buffer_size = max(rounddown(dev->buffer_size / 2, dev->block_size), min_size);
+	}
+
+	for(unsigned i = 0 ; i < dev->bounce_count ; i++)
+	{
+		if (i != 0)
+			dev->bounce[i] = (void*) __get_free_pages(GFP_KERNEL, dev->bounce_order);
+		if (!dev->bounce[i])
+		{
+			// make do with however many we have
+			dev->bounce_count = i;
+			break;
+		}
+
+		__set_bit(i, &dev->bounce_free);
+	}
+
+	dev->buffer = dev->bounce[0];
+	return 0;
+}
+
+// Copy len bytes between the request segments, starting at
+// byte offset into the request, and a linear buffer.
+static void uefi_blockdev_copy(struct request * rq, size_t offset, uint8_t * buf, size_t len, bool to_buf)
+{
+	struct bio_vec bvec;
+	struct req_iterator iter;
+
+	rq_for_each_segment(bvec, rq, iter) {
+		size_t seg_len = bvec.bv_len;
+		size_t seg_off = 0;
+		char * buffer;
+
+		if (len == 0)
+			break;
+
+		// skip the segments before the window
+		if (offset >= seg_len)
+		{
+			offset -= seg_len;
+			continue;
+		}
+
+		seg_off = offset;
+		seg_len = min(seg_len - seg_off, len);
+		offset = 0;
+
+		buffer = kmap_atomic(bvec.bv_page);
+		if (to_buf)
+			memcpy(buf, buffer + bvec.bv_offset + seg_off, seg_len);
+		else
+			memcpy(buffer + bvec.bv_offset + seg_off, buf, seg_len);
+		kunmap_atomic(buffer);
+
+		buf += seg_len;
+		len -= seg_len;
+	}
+}
+
+static uefi_blockdev_cache_t * uefi_blockdev_cache_find(uefi_blockdev_t * dev, EFI_LBA lba)
+{
+	uefi_blockdev_cache_t * entry;
+
+	hash_for_each_possible(dev->cache_hash, entry, hash, lba)
+		if (entry->lba == lba)
+			return entry;
+
+	return NULL;
+}
+
+// Throw away everything in the cache, only from the worker
+static void uefi_blockdev_cache_drop(uefi_blockdev_t * dev)
+{
+	uefi_blockdev_cache_t * entry;
+	uefi_blockdev_cache_t * next;
+
+	list_for_each_entry_safe(entry, next, &dev->cache_lru, lru)
+		kfree(entry);
+	INIT_LIST_HEAD(&dev->cache_lru);
+	hash_init(dev->cache_hash);
+	dev->cache_count = 0;
+}
+
+// Drop the cache if another device over the same sectors has been
+// written to since this one last checked.  The generation changes
+// too, so that reads that are in flight aren't cached either.
+static void uefi_blockdev_cache_sync(uefi_blockdev_t * dev)
+{
+	const uefi_blockdev_group_t * group = READ_ONCE(dev->group);
+
+	if (!group || group->writes == dev->group_writes)
+		return;
+
+	uefi_blockdev_cache_drop(dev);
+	dev->cache_gen++;
+	dev->group_writes = group->writes;
+}
+
+// Try to satisfy a read entirely from the cache, returns true if
+// every block was present and has been copied into the request.
+static bool uefi_blockdev_cache_read(uefi_blockdev_t * dev, struct request * rq)
+{
+	const size_t bs = dev->block_size;
+	const uint64_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	const EFI_LBA lba = pos / bs;
+	const size_t len = blk_rq_bytes(rq);
+	const size_t blocks = len / bs;
+
+	if (dev->cache_max == 0
+	||  rq_data_dir(rq) == WRITE
+	||  ((pos | len) & (bs - 1)) != 0)
+		return false;
+
+	uefi_blockdev_cache_sync(dev);
+
+	for(size_t i = 0 ; i < blocks ; i++)
+	{
+		if (uefi_blockdev_cache_find(dev, lba + i))
+			continue;
+
+		dev->cache_misses++;
+		return false;
+	}
+
+	for(size_t i = 0 ; i < blocks ; i++)
+	{
+		uefi_blockdev_cache_t * entry = uefi_blockdev_cache_find(dev, lba + i);
+		uefi_blockdev_copy(rq, i * bs, entry->data, bs, false);
+		list_move(&entry->lru, &dev->cache_lru);
+	}
+
+	dev->cache_hits++;
+	return true;
+}
+
+// Store the blocks of a completed read, unless there has been a
+// write to the device since the read was started.
+static void uefi_blockdev_cache_fill(uefi_blockdev_t * dev, struct request * rq, unsigned long gen)
+{
+	const size_t bs = dev->block_size;
+	const uint64_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	const EFI_LBA lba = pos / bs;
+	const size_t len = blk_rq_bytes(rq);
+	const size_t blocks = len / bs;
+
+	uefi_blockdev_cache_sync(dev);
+
+	if (dev->cache_max == 0
+	||  rq_data_dir(rq) == WRITE
+	||  ((pos | len) & (bs - 1)) != 0
+	||  gen != dev->cache_gen)
+		return;
+
+	for(size_t i = 0 ; i < blocks ; i++)
+	{
+		uefi_blockdev_cache_t * entry = uefi_blockdev_cache_find(dev, lba + i);
+
+		if (entry)
+		{
+			// already present, just refresh it
+			list_move(&entry->lru, &dev->cache_lru);
+		} else {
+			if (dev->cache_count < dev->cache_max)
+			{
+				entry = kmalloc(sizeof(*entry) + bs, GFP_NOIO);
+				if (!entry)
+					return;
+				dev->cache_count++;
+			} else {
+				// reuse the least recently used block
+				entry = list_last_entry(&dev->cache_lru, uefi_blockdev_cache_t, lru);
+				hash_del(&entry->hash);
+				list_del(&entry->lru);
+			}
+
+			entry->lba = lba + i;
+			hash_add(dev->cache_hash, &entry->hash, entry->lba);
+			list_add(&entry->lru, &dev->cache_lru);
+		}
+
+		uefi_blockdev_copy(rq, i * bs, entry->data, bs, true);
+	}
+}
+
+// Drop any cached blocks that a write request overlaps, here and
+// (all of them) in the other devices that alias these sectors.
+static void uefi_blockdev_cache_invalidate(uefi_blockdev_t * dev, struct request * rq)
+{
+	const size_t bs = dev->block_size;
+	const uint64_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	const EFI_LBA lba = pos / bs;
+	const size_t blocks = DIV_ROUND_UP((pos & (bs - 1)) + blk_rq_bytes(rq), bs);
+	uefi_blockdev_group_t * group = READ_ONCE(dev->group);
+
+	uefi_blockdev_cache_sync(dev);
+	dev->cache_gen++;
+
+	if (group)
+		dev->group_writes = ++group->writes;
+
+	for(size_t i = 0 ; i < blocks && dev->cache_count ; i++)
+	{
+		uefi_blockdev_cache_t * entry = uefi_blockdev_cache_find(dev, lba + i);
+		if (!entry)
+			continue;
+
+		hash_del(&entry->hash);
+		list_del(&entry->lru);
+		kfree(entry);
+		dev->cache_count--;
+	}
+}
+
+// Write out anything in the firmware's write cache
+static int uefi_blockdev_flush(uefi_blockdev_t * dev)
+{
+	unsigned long flags;
+	int status;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
+
+	status = uefi_call("FlushBlocks", dev->uefi_bio->FlushBlocks, dev->uefi_bio);
+	uefi_firmware_exit(flags);
+
+	dev->stats.firmware_calls++;
+
+	if (status)
+		printk("%s: flush failed %x\n", dev->gd->disk_name, status);
+
+	return status;
+}
+
+// Byte granular transfer with the DiskIo protocol, which takes
+// care of any partial blocks at either end.
+static int uefi_blockdev_diskio(uefi_blockdev_t * dev, bool is_write, uint64_t pos, size_t len, void * buf)
+{
+	unsigned long flags;
+	u64 start_ns;
+	int status;
+
+	if (debug)
+	printk("%s.%d: %s @%08llx + %08zx <=> %016llx\n",
+		dev->gd->disk_name,
+		dev->media_id,
+		is_write ? "WRITE" : "READ ",
+		pos,
+		len,
+		(uint64_t) buf
+	);
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
+
+	start_ns = ktime_get_ns();
+	if (is_write)
+		status = uefi_call_timeout("WriteDisk", uefi_watchdog_timeout(len), dev->uefi_diskio->WriteDisk,
+			dev->uefi_diskio,
+			dev->media_id,
+			pos,
+			len,
+			buf
+		);
+	else
+		status = uefi_call_timeout("ReadDisk", uefi_watchdog_timeout(len), dev->uefi_diskio->ReadDisk,
+			dev->uefi_diskio,
+			dev->media_id,
+			pos,
+			len,
+			buf
+		);
+
+	uefi_firmware_exit(flags);
+
+	dev->stats.firmware_calls++;
+	uefi_blockdev_latency(dev, is_write, start_ns);
+
+	return status;
+}
+
+// Perform the firmware calls for a request. This runs in the
+// worker thread, so the firmware is free to take its time.
+static int uefi_blockdev_request(struct request * rq)
+{
+	uefi_blockdev_t * dev = rq->rq_disk->private_data;
+	const bool is_write = rq_data_dir(rq) == WRITE;
+	const size_t bs = dev->block_size;
+	// sector is *always* in Linux 512 blocks
+	const uint64_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	const size_t len = blk_rq_bytes(rq);
+	const bool aligned = ((pos | len) & (bs - 1)) == 0;
+	void * direct;
+	int status = 0;
+
+	// a contiguous request can be handed to the firmware in one
+	// call with no copies, if it is whole blocks or DiskIo can
+	// deal with the partial ones.
+	direct = uefi_blockdev_contiguous(dev, rq);
+
+	if (!direct)
+		dev->stats.bounces++;
+	if (!aligned)
+		dev->stats.partials++;
+
+	if (direct && aligned)
+	{
+		status = uefi_blockdev_xfer(dev, is_write, pos / bs, len, direct);
+	} else
+	if (direct && dev->uefi_diskio)
+	{
+		status = uefi_blockdev_diskio(dev, is_write, pos, len, direct);
+	} else
+	if (!aligned && dev->uefi_diskio)
+	{
+		// gather the segments through the staging buffer
+		for(size_t offset = 0 ; offset < len ; offset += dev->buffer_size)
+		{
+			const size_t chunk_len = min(len - offset, dev->buffer_size);
+
+			if (is_write)
+				uefi_blockdev_copy(rq, offset, dev->buffer, chunk_len, true);
+
+			status = uefi_blockdev_diskio(dev, is_write, pos + offset, chunk_len, dev->buffer);
+			if (status)
+				break;
+
+			if (!is_write)
+				uefi_blockdev_copy(rq, offset, dev->buffer, chunk_len, false);
+		}
+	} else {
+		// otherwise gather the segments through the staging buffer,
+		// which is sized in whole blocks.  without DiskIo the
+		// 512 byte sectors end up here, and any partial block at
+		// either end of a write has to be read in first.
+		size_t chunk_len;
+
+		for(size_t offset = 0 ; offset < len ; offset += chunk_len)
+		{
+			const uint64_t chunk_pos = pos + offset;
+			const size_t head = chunk_pos & (bs - 1);
+			EFI_LBA chunk_lba = chunk_pos / bs;
+			size_t blocks_len;
+
+			chunk_len = min(len - offset, dev->buffer_size - head);
+			blocks_len = round_up(head + chunk_len, bs);
+
+			// the first failure is the one that is reported, and
+			// the rest of the request isn't attempted
+			if (!is_write || head != 0 || blocks_len != head + chunk_len)
+				status = uefi_blockdev_xfer(dev, false, chunk_lba, blocks_len, dev->buffer);
+			if (status)
+				break;
+
+			if (is_write)
+			{
+				uefi_blockdev_copy(rq, offset, dev->buffer + head, chunk_len, true);
+				status = uefi_blockdev_xfer(dev, true, chunk_lba, blocks_len, dev->buffer);
+				if (status)
+					break;
+			} else {
+				uefi_blockdev_copy(rq, offset, dev->buffer + head, chunk_len, false);
+			}
+		}
+	}
+
+	// emulate forced unit access by flushing after the write
+	if (status == 0 && is_write && (rq->cmd_flags & REQ_FUA))
+		status = uefi_blockdev_flush(dev);
+
+	if (status)
+		printk("%s: operation failed %x\n", dev->gd->disk_name, status);
+
+	return status;
+}
+
+// Start an asynchronous BlockIo2 transfer for the request.
+// Returns 0 if it is in flight, a negative value if it could not be
+// started and should use the synchronous path instead, or the
+// firmware status if the firmware rejected it.
+static int uefi_blockdev_submit(struct request * rq)
+{
+	uefi_blockdev_t * dev = rq->rq_disk->private_data;
+	uefi_blockdev_cmd_t * cmd = blk_mq_rq_to_pdu(rq);
+	const bool is_write = rq_data_dir(rq) == WRITE;
+	const size_t bs = dev->block_size;
+	const uint64_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	const EFI_LBA lba = pos / bs;
+	const size_t len = blk_rq_bytes(rq);
+	uint8_t * buf = uefi_blockdev_contiguous(dev, rq);
+	unsigned long flags;
+	int status;
+
+	// partial blocks and large requests are left to the synchronous path
+	if (((pos | len) & (bs - 1)) != 0)
+		return -1;
+	if (!buf && len > dev->buffer_size)
+		return -1;
+
+	cmd->buffer = NULL;
+	cmd->bounce = -1;
+	if (!buf)
+	{
+		// each request in flight needs its own bounce buffer
+		cmd->bounce = uefi_blockdev_bounce_get(dev);
+		if (cmd->bounce < 0)
+			return -1;
+		dev->stats.bounces++;
+		buf = cmd->buffer = dev->bounce[cmd->bounce];
+		if (is_write)
+			uefi_blockdev_copy(rq, 0, buf, len, true);
+	}
+
+	cmd->token.TransactionStatus = 0;
+	cmd->token.Event = uefi_create_event();
+	if (!cmd->token.Event)
+	{
+		uefi_blockdev_bounce_put(dev, cmd->bounce);
+		return -1;
+	}
+
+	if (debug)
+	printk("%s.%d: %s %08llx + %08zx <=> %016llx async\n",
+		dev->gd->disk_name,
+		dev->media_id,
+		is_write ? "WRITE" : "READ ",
+		lba,
+		len,
+		(uint64_t) buf
+	);
+
+	if (uefi_firmware_enter(&flags) < 0)
+	{
+		uefi_close_event(cmd->token.Event);
+		uefi_blockdev_bounce_put(dev, cmd->bounce);
+		return -1;
+	}
+
+	cmd->start_ns = ktime_get_ns();
+
+	if (is_write)
+		status = uefi_call_timeout("WriteBlocksEx", uefi_watchdog_timeout(len), dev->uefi_bio2->WriteBlocksEx,
+			dev->uefi_bio2,
+			dev->media_id,
+			lba,
+			&cmd->token,
+			len,
+			buf
+		);
+	else
+		status = uefi_call_timeout("ReadBlocksEx", uefi_watchdog_timeout(len), dev->uefi_bio2->ReadBlocksEx,
+			dev->uefi_bio2,
+			dev->media_id,
+			lba,
+			&cmd->token,
+			len,
+			buf
+		);
+
+	uefi_firmware_exit(flags);
+	dev->stats.firmware_calls++;
+
+	if (status != 0)
+	{
+		printk("%s: async operation failed %x\n", dev->gd->disk_name, status);
+		uefi_close_event(cmd->token.Event);
+		uefi_blockdev_bounce_put(dev, cmd->bounce);
+		return status;
+	}
+
+	list_add_tail(&cmd->list, &uefi_blockdev_inflight);
+	return 0;
+}
+
+// Complete the BlockIo2 transfer that has signaled its token
+static void uefi_blockdev_finish(uefi_blockdev_cmd_t * cmd)
+{
+	struct request * rq = blk_mq_rq_from_pdu(cmd);
+	uefi_blockdev_t * dev = rq->rq_disk->private_data;
+	int status = cmd->token.TransactionStatus;
+
+	uefi_blockdev_latency(dev, rq_data_dir(rq) == WRITE, cmd->start_ns);
+
+	if (status)
+		printk("%s: async operation failed %x\n", dev->gd->disk_name, status);
+	else
+	if (cmd->buffer && rq_data_dir(rq) != WRITE)
+		uefi_blockdev_copy(rq, 0, cmd->buffer, blk_rq_bytes(rq), false);
+	else
+	if (rq_data_dir(rq) == WRITE && (rq->cmd_flags & REQ_FUA))
+		status = uefi_blockdev_flush(dev);
+
+	if (!status)
+		uefi_blockdev_cache_fill(dev, rq, cmd->cache_gen);
+
+	uefi_close_event(cmd->token.Event);
+	uefi_blockdev_bounce_put(dev, cmd->bounce);
+	cmd->buffer = NULL;
+
+	uefi_blockdev_end(dev, rq, status);
+}
+
+// Give the firmware a chance to make progress on the requests
+// in flight and complete any that are done.  The firmware clock
+// only ticks once per timer period however often this is called,
+// and the events are checked every time in between.
+static int uefi_blockdev_poll(void)
+{
+	uefi_blockdev_cmd_t * cmd;
+	uefi_blockdev_cmd_t * next;
+	int count = 0;
+
+	uefi_timer_tick();
+
+	list_for_each_entry_safe(cmd, next, &uefi_blockdev_inflight, list)
+	{
+		uefi_blockdev_t * dev = blk_mq_rq_from_pdu(cmd)->rq_disk->private_data;
+
+		// the firmware might still finish the requests that are
+		// given up on here after the stuck call comes back, so
+		// the disk that owns them is not used again.
+		if (uefi_firmware_is_dead() && !READ_ONCE(dev->dead))
+		{
+			printk(KERN_ERR "%s: firmware is dead, abandoning requests in flight\n", dev->gd->disk_name);
+			WRITE_ONCE(dev->dead, true);
+		}
+
+		// a removed handle is never going to signal them, and
+		// removal waits for them to finish
+		if (READ_ONCE(dev->dead))
+			cmd->token.TransactionStatus = 7; // EFI_DEVICE_ERROR
+		else
+		if (uefi_check_event(cmd->token.Event) != 0)
+			continue;
+
+		list_del_init(&cmd->list);
+		uefi_blockdev_finish(cmd);
+		count++;
+	}
+
+	return count;
+}
+
+// Take the next request from the hardware queue at the front of
+// the ready list, and send that queue to the back of the line.
+static uefi_blockdev_cmd_t * uefi_blockdev_next(void)
+{
+	uefi_blockdev_hwq_t * hwq;
+	uefi_blockdev_cmd_t * cmd = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&uefi_blockdev_pending_lock, flags);
+
+	hwq = list_first_entry_or_null(&uefi_blockdev_ready, uefi_blockdev_hwq_t, ready);
+	if (hwq)
+	{
+		cmd = list_first_entry(&hwq->pending, uefi_blockdev_cmd_t, list);
+		list_del_init(&cmd->list);
+
+		list_del_init(&hwq->ready);
+		if (!list_empty(&hwq->pending))
+			list_add_tail(&hwq->ready, &uefi_blockdev_ready);
+	}
+
+	spin_unlock_irqrestore(&uefi_blockdev_pending_lock, flags);
+
+	return cmd;
+}
+
+// The block requests are fed to the firmware from a single thread
+// pinned to the boot CPU; queue_rq on any CPU only puts the request
+// on its hardware queue's list.  Each firmware call takes the global
+// firmware lock and releases it afterwards, so the NICs and TPM get
+// their turn between transfers.  BlockIo2 devices can have as many
+// requests in flight as the tag set allows, the others are done one
+// at a time.
+static int uefi_blockdev_worker(void * unused)
+{
+	while (!kthread_should_stop())
+	{
+		uefi_blockdev_cmd_t * cmd;
+		struct request * rq;
+		uefi_blockdev_t * dev;
+		int status;
+
+		if (list_empty(&uefi_blockdev_inflight))
+			wait_event_interruptible(uefi_blockdev_wait,
+				kthread_should_stop() || !list_empty(&uefi_blockdev_ready));
+
+		while ((cmd = uefi_blockdev_next()) != NULL)
+		{
+			cond_resched();
+
+			rq = blk_mq_rq_from_pdu(cmd);
+			dev = rq->rq_disk->private_data;
+
+			// queued before the disk was removed
+			if (READ_ONCE(dev->dead))
+			{
+				dev->stats.errors++;
+				blk_mq_end_request(rq, BLK_STS_IOERR);
+				continue;
+			}
+
+			// don't bother the firmware until the new
+			// media has been revalidated
+			if (dev->media_changed)
+			{
+				uefi_blockdev_end(dev, rq, 13); // EFI_MEDIA_CHANGED
+				continue;
+			}
+
+			if (dev->cache_media_id != dev->media_id)
+			{
+				uefi_blockdev_cache_drop(dev);
+				dev->cache_media_id = dev->media_id;
+			}
+
+			if (req_op(rq) == REQ_OP_FLUSH)
+			{
+				dev->stats.flushes++;
+				status = uefi_blockdev_flush(dev);
+				uefi_blockdev_end(dev, rq, status);
+				continue;
+			}
+
+			dev->stats.segments += blk_rq_nr_phys_segments(rq);
+			if (rq_data_dir(rq) == WRITE)
+			{
+				dev->stats.writes++;
+				dev->stats.write_bytes += blk_rq_bytes(rq);
+			} else {
+				dev->stats.reads++;
+				dev->stats.read_bytes += blk_rq_bytes(rq);
+			}
+
+			if (uefi_blockdev_cache_read(dev, rq))
+			{
+				blk_mq_end_request(rq, BLK_STS_OK);
+				continue;
+			}
+
+			if (rq_data_dir(rq) == WRITE)
+				uefi_blockdev_cache_invalidate(dev, rq);
+			cmd->cache_gen = dev->cache_gen;
+
+			status = -1;
+			if (dev->uefi_bio2)
+				status = uefi_blockdev_submit(rq);
+			if (status == 0)
+				continue;
+			if (status < 0)
+			{
+				status = uefi_blockdev_request(rq);
+				if (status == 0)
+					uefi_blockdev_cache_fill(dev, rq, cmd->cache_gen);
+			}
+
+			uefi_blockdev_end(dev, rq, status);
+		}
+
+		if (list_empty(&uefi_blockdev_inflight))
+			continue;
+
+		if (uefi_blockdev_poll() == 0)
+			usleep_range(poll_us, 2 * poll_us);
+	}
+
+	return 0;
+}
+
+// RAM disks are just memory, so there is no need to bother
+// the firmware or the worker thread to copy to or from them.
+static blk_status_t uefi_blockdev_ramdisk_request(uefi_blockdev_t * dev, struct request * rq)
+{
+	const bool is_write = rq_data_dir(rq) == WRITE;
+	const size_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	const size_t len = blk_rq_bytes(rq);
+
+	if (pos + len > dev->ramdisk_size)
+		return BLK_STS_IOERR;
+	if (is_write && dev->ramdisk_ro)
+		return BLK_STS_IOERR;
+
+	blk_mq_start_request(rq);
+	uefi_blockdev_copy(rq, 0, dev->ramdisk + pos, len, is_write);
+	blk_mq_end_request(rq, BLK_STS_OK);
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t uefi_blockdev_queue_rq(struct blk_mq_hw_ctx * hctx, const struct blk_mq_queue_data * bd)
+{
+	struct request * rq = bd->rq;
+	uefi_blockdev_t * dev = rq->rq_disk->private_data;
+	uefi_blockdev_cmd_t * cmd = blk_mq_rq_to_pdu(rq);
+	uefi_blockdev_hwq_t * hwq = hctx->driver_data;
+	unsigned long flags;
+
+	if (blk_rq_is_passthrough(rq))
+	{
+		printk(KERN_NOTICE "skip non-fs request\n");
+		return BLK_STS_IOERR;
+	}
+
+	// the handle, and any RAM disk behind it, are gone
+	if (READ_ONCE(dev->dead))
+		return BLK_STS_IOERR;
+
+	if (dev->ramdisk)
+		return uefi_blockdev_ramdisk_request(dev, rq);
+
+	// don't queue behind a firmware call that might never come back
+	if (uefi_firmware_is_dead())
+		return BLK_STS_IOERR;
+
+	blk_mq_start_request(rq);
+
+	spin_lock_irqsave(&uefi_blockdev_pending_lock, flags);
+	list_add_tail(&cmd->list, &hwq->pending);
+	if (list_empty(&hwq->ready))
+		list_add_tail(&hwq->ready, &uefi_blockdev_ready);
+	spin_unlock_irqrestore(&uefi_blockdev_pending_lock, flags);
+
+	wake_up(&uefi_blockdev_wait);
+	return BLK_STS_OK;
+}
+
+static int uefi_blockdev_init_hctx(struct blk_mq_hw_ctx * hctx, void * data, unsigned int index)
+{
+	uefi_blockdev_hwq_t * hwq = kzalloc(sizeof(*hwq), GFP_KERNEL);
+	if (!hwq)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&hwq->ready);
+	INIT_LIST_HEAD(&hwq->pending);
+	hctx->driver_data = hwq;
+
+	return 0;
+}
+
+static void uefi_blockdev_exit_hctx(struct blk_mq_hw_ctx * hctx, unsigned int index)
+{
+	kfree(hctx->driver_data);
+	hctx->driver_data = NULL;
+}
+
+static struct blk_mq_ops uefi_blockdev_qops = {
+	.queue_rq	= uefi_blockdev_queue_rq,
+	.init_hctx	= uefi_blockdev_init_hctx,
+	.exit_hctx	= uefi_blockdev_exit_hctx,
+};
+
+static int uefi_blockdev_open(struct block_device * bd, fmode_t mode)
+{
+	uefi_blockdev_t * const dev = bd->bd_disk->private_data;
+
+	// 5.4 only revalidates after a media change if the driver asks,
+	// which also has the partitions rescanned by blkdev_get()
+	if (dev->removable)
+		check_disk_change(bd);
+
+	atomic_inc(&dev->refcnt);
+	//printk("opened '%s'\n", bd->bd_disk->disk_name);
+	return 0;
+}
+
+// the device is freed once it has been removed and the last
+// user has closed it
+static void uefi_blockdev_put(uefi_blockdev_t * dev)
+{
+	if (atomic_dec_and_test(&dev->refcnt))
+		kfree(dev);
+}
+
+static void uefi_blockdev_release(struct gendisk * disk, fmode_t mode)
+{
+	uefi_blockdev_t * const dev = disk->private_data;
+	uefi_blockdev_put(dev);
+}
+
+// Ask the firmware if the removable media is still the one we know
+// about.  A zero length read makes the USB mass storage driver (and
+// others) check the drive, and fails if the MediaId is stale.
+// Returns true if there has been a change.
+static bool uefi_blockdev_media_probe(uefi_blockdev_t * dev)
+{
+	const EFI_BLOCK_IO_MEDIA * media;
+	unsigned long flags;
+	uint8_t dummy;
+	int status;
+
+	if (!dev->removable || dev->media_changed || READ_ONCE(dev->dead))
+		return dev->media_changed;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return false;
+
+	media = dev->uefi_bio->Media;
+	status = uefi_call("ReadBlocks", dev->uefi_bio->ReadBlocks, dev->uefi_bio, dev->media_id, 0, 0, &dummy);
+	if (status == 0
+	&& (media->MediaId != dev->media_id || !media->MediaPresent != !dev->media_present))
+		status = 13; // EFI_MEDIA_CHANGED
+
+	uefi_firmware_exit(flags);
+
+	return uefi_blockdev_media_error(dev, status);
+}
+
+static unsigned int uefi_blockdev_check_events(struct gendisk * disk, unsigned int clearing)
+{
+	uefi_blockdev_t * const dev = disk->private_data;
+	return uefi_blockdev_media_probe(dev) ? DISK_EVENT_MEDIA_CHANGE : 0;
+}
+
+// Called by the block layer after a media change: reset the drive so
+// that the firmware reads the new media's details, and pick up the
+// new MediaId and capacity.  The worker drops the read cache when it
+// sees the new MediaId.
+static int uefi_blockdev_revalidate(struct gendisk * disk)
+{
+	uefi_blockdev_t * const dev = disk->private_data;
+	const EFI_BLOCK_IO_MEDIA * media;
+	sector_t capacity = 0;
+	unsigned long flags;
+	int status;
+
+	if (READ_ONCE(dev->dead))
+		return -ENODEV;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return -EBUSY;
+
+	status = uefi_call("Reset", dev->uefi_bio->Reset, dev->uefi_bio, 0);
+	media = dev->uefi_bio->Media;
+
+	dev->media_id = media->MediaId;
+	dev->media_present = media->MediaPresent;
+
+	// the buffers and queue limits are sized for the old block
+	// size, so media with a different one can't be used
+	if (media->MediaPresent && media->BlockSize == dev->block_size)
+		capacity = (media->LastBlock + 1) * (media->BlockSize / 512);
+
+	uefi_firmware_exit(flags);
+
+	if (status != 0)
+		printk("%s: reset failed %x\n", disk->disk_name, status);
+	if (dev->media_present && capacity == 0)
+		printk("%s: new media has a different block size\n", disk->disk_name);
+
+	printk("%s: media id=%u present=%d size=%llu\n",
+		disk->disk_name,
+		dev->media_id,
+		dev->media_present,
+		(uint64_t) capacity << SECTOR_SHIFT);
+
+	set_capacity(disk, capacity);
+	dev->media_changed = false;
+
+	return 0;
+}
+
+/* // todo: support ioctl
+static int uefi_blockdev_ioctl(struct inode * inode, struct file * filp, unsigned int cmd, unsigned long arg)
+{
+	uefi_blockdev_t * const dev = inode->i_bdev->bd_disk->private_data;
+	struct hd_geometry geo = {
+		.heads = 4,
+		.sectors = 16,
+		.start = 0,
+		.cylinders = dev->uefi_bio->Media->LastBlock / 4 / 16,
+	};
+
+	switch(cmd) {
+	case HDIO_GETGEO:
+		if (copy_to_user((void __user *) arg, &geo, sizeof(geo)))
+			return -EFAULT;
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+*/
+
+
+static struct block_device_operations uefi_blockdev_fops = {
+	.owner		= THIS_MODULE,
+	.open		= uefi_blockdev_open,
+	.release	= uefi_blockdev_release,
+	.check_events	= uefi_blockdev_check_events,
+	.revalidate_disk = uefi_blockdev_revalidate,
+	// .ioctl		= uefi_blockdev_ioctl,
+};
+
+
+static ssize_t sysfs_devpath_show(struct device * dev, struct device_attribute * attr, char * buf)
+{
+	struct gendisk * disk = dev_to_disk(dev);
+	uefi_blockdev_t * uefi = disk->private_data;
+	sprintf(buf, "%s\n", uefi->devicepath_string);
+	return strlen(buf);
+}
+
+static ssize_t sysfs_handle_show(struct device * dev, struct device_attribute * attr, char * buf)
+{
+	struct gendisk * disk = dev_to_disk(dev);
+	uefi_blockdev_t * uefi = disk->private_data;
+	sprintf(buf, "0x%016llx\n", (uint64_t) uefi->uefi_handle);
+	return strlen(buf);
+}
+
+static ssize_t sysfs_cache_hits_show(struct device * dev, struct device_attribute * attr, char * buf)
+{
+	struct gendisk * disk = dev_to_disk(dev);
+	uefi_blockdev_t * uefi = disk->private_data;
+	sprintf(buf, "%lu\n", uefi->cache_hits);
+	return strlen(buf);
+}
+
+static ssize_t sysfs_cache_misses_show(struct device * dev, struct device_attribute * attr, char * buf)
+{
+	struct gendisk * disk = dev_to_disk(dev);
+	uefi_blockdev_t * uefi = disk->private_data;
+	sprintf(buf, "%lu\n", uefi->cache_misses);
+	return strlen(buf);
+}
+
+// one value per file in the uefi_stats directory of each disk
+#define UEFI_BLOCKDEV_STAT(name) \
+static ssize_t sysfs_stats_##name##_show(struct device * dev, struct device_attribute * attr, char * buf) \
+{ \
+	uefi_blockdev_t * uefi = dev_to_disk(dev)->private_data; \
+	return sprintf(buf, "%lu\n", READ_ONCE(uefi->stats.name)); \
+} \
+static struct device_attribute dev_attr_stats_##name = __ATTR(name, 0444, sysfs_stats_##name##_show, NULL)
+
+UEFI_BLOCKDEV_STAT(reads);
+UEFI_BLOCKDEV_STAT(writes);
+UEFI_BLOCKDEV_STAT(flushes);
+UEFI_BLOCKDEV_STAT(segments);
+UEFI_BLOCKDEV_STAT(read_bytes);
+UEFI_BLOCKDEV_STAT(write_bytes);
+UEFI_BLOCKDEV_STAT(firmware_calls);
+UEFI_BLOCKDEV_STAT(bounces);
+UEFI_BLOCKDEV_STAT(partials);
+UEFI_BLOCKDEV_STAT(errors);
+
+static struct attribute * uefi_blockdev_stats_attrs[] = {
+	&dev_attr_stats_reads.attr,
+	&dev_attr_stats_writes.attr,
+	&dev_attr_stats_flushes.attr,
+	&dev_attr_stats_segments.attr,
+	&dev_attr_stats_read_bytes.attr,
+	&dev_attr_stats_write_bytes.attr,
+	&dev_attr_stats_firmware_calls.attr,
+	&dev_attr_stats_bounces.attr,
+	&dev_attr_stats_partials.attr,
+	&dev_attr_stats_errors.attr,
+	NULL,
+};
+
+static const struct attribute_group uefi_blockdev_stats_group = {
+	.name = "uefi_stats",
+	.attrs = uefi_blockdev_stats_attrs,
+};
+
+// The latency histograms are one line per bucket, with the upper
+// bound in microseconds, so they go in debugfs rather than sysfs.
+
+static void uefi_blockdev_latency_show(struct seq_file * m, const unsigned long * latency)
+{
+	for(unsigned i = 0 ; i < UEFI_BLOCKDEV_LATENCY_BUCKETS - 1 ; i++)
+		seq_printf(m, "%lu %lu\n", 1UL << i, READ_ONCE(latency[i]));
+
+	seq_printf(m, "inf %lu\n", READ_ONCE(latency[UEFI_BLOCKDEV_LATENCY_BUCKETS - 1]));
+}
+
+static int read_latency_show(struct seq_file * m, void * unused)
+{
+	uefi_blockdev_t * uefi = m->private;
+	uefi_blockdev_latency_show(m, uefi->stats.read_latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(read_latency);
+
+static int write_latency_show(struct seq_file * m, void * unused)
+{
+	uefi_blockdev_t * uefi = m->private;
+	uefi_blockdev_latency_show(m, uefi->stats.write_latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(write_latency);
+
+static DEVICE_ATTR(uefi_devicepath, 0444, sysfs_devpath_show, NULL);
+static DEVICE_ATTR(uefi_handle, 0444, sysfs_handle_show, NULL);
+static DEVICE_ATTR(uefi_cache_hits, 0444, sysfs_cache_hits_show, NULL);
+static DEVICE_ATTR(uefi_cache_misses, 0444, sysfs_cache_misses_show, NULL);
+
+// the partitions have their own copies of the UEFI handle and
+// device path, which are found through their parent disk
+static uefi_blockdev_part_t * uefi_blockdev_part(struct device * dev)
+{
+	struct hd_struct * part = dev_to_part(dev);
+	uefi_blockdev_t * uefi = part_to_disk(part)->private_data;
+	return &uefi->parts[part->partno];
+}
+
+static ssize_t sysfs_part_devpath_show(struct device * dev, struct device_attribute * attr, char * buf)
+{
+	sprintf(buf, "%s\n", uefi_blockdev_part(dev)->devicepath_string);
+	return strlen(buf);
+}
+
+static ssize_t sysfs_part_handle_show(struct device * dev, struct device_attribute * attr, char * buf)
+{
+	sprintf(buf, "0x%016llx\n", (uint64_t) uefi_blockdev_part(dev)->uefi_handle);
+	return strlen(buf);
+}
+
+static struct device_attribute dev_attr_part_devicepath
+	= __ATTR(uefi_devicepath, 0444, sysfs_part_devpath_show, NULL);
+static struct device_attribute dev_attr_part_handle
+	= __ATTR(uefi_handle, 0444, sysfs_part_handle_show, NULL);
+
+struct attribute * uefi_blockdev_part_attrs[] = {
+	&dev_attr_part_devicepath.attr,
+	&dev_attr_part_handle.attr,
+	NULL,
+};
+
+struct attribute * uefi_blockdev_attrs[] = {
+	&dev_attr_uefi_devicepath.attr,
+	&dev_attr_uefi_handle.attr,
+	&dev_attr_uefi_cache_hits.attr,
+	&dev_attr_uefi_cache_misses.attr,
+	NULL,
+};
+
+
+#ifdef CONFIG_UEFIBLOCK_DAX
+static long uefi_blockdev_dax_direct_access(struct dax_device * dax_dev, pgoff_t pgoff, long nr_pages, void ** kaddr, pfn_t * pfn)
+{
+	uefi_blockdev_t * dev = dax_get_private(dax_dev);
+	const size_t offset = (size_t) pgoff << PAGE_SHIFT;
+
+	if (offset >= dev->ramdisk_size)
+		return -ERANGE;
+
+	if (kaddr)
+		*kaddr = dev->ramdisk + offset;
+	if (pfn)
+		*pfn = phys_to_pfn_t(dev->ramdisk_phys + offset, PFN_DEV | PFN_MAP);
+
+	return (dev->ramdisk_size - offset) >> PAGE_SHIFT;
+}
+
+static size_t uefi_blockdev_dax_copy_from_iter(struct dax_device * dax_dev, pgoff_t pgoff, void * addr, size_t bytes, struct iov_iter * i)
+{
+	return copy_from_iter(addr, bytes, i);
+}
+
+static size_t uefi_blockdev_dax_copy_to_iter(struct dax_device * dax_dev, pgoff_t pgoff, void * addr, size_t bytes, struct iov_iter * i)
+{
+	return copy_to_iter(addr, bytes, i);
+}
+
+static const struct dax_operations uefi_blockdev_dax_ops = {
+	.direct_access	= uefi_blockdev_dax_direct_access,
+	.dax_supported	= generic_fsdax_supported,
+	.copy_from_iter	= uefi_blockdev_dax_copy_from_iter,
+	.copy_to_iter	= uefi_blockdev_dax_copy_to_iter,
+};
+
+// Filesystem DAX needs struct pages for the memory, which the UEFI
+// memory does not have since it is outside of the Linux memory map.
+// memremap_pages() can create them, as long as the RAM disk starts
+// and ends on a memory subsection boundary.  It can't be rounded up,
+// since whatever follows the disk belongs to someone else, so the
+// other ones use the normal memremap() path.
+static void * uefi_blockdev_dax_map(uefi_blockdev_t * dev, uint64_t start, size_t size)
+{
+	const size_t align = PAGES_PER_SUBSECTION << PAGE_SHIFT;
+	void * addr;
 
-	char devicepath_string[256];
-} uefi_blockdev_t;
+	if (!IS_ALIGNED(start, align) || !IS_ALIGNED(size, align))
+		return NULL;
+
+	dev->pgmap.type = MEMORY_DEVICE_FS_DAX;
+	dev->pgmap.res.name = "uefi ramdisk";
+	dev->pgmap.res.flags = IORESOURCE_MEM;
+	dev->pgmap.res.start = start;
+	dev->pgmap.res.end = start + size - 1;
+
+	addr = memremap_pages(&dev->pgmap, NUMA_NO_NODE);
+	if (IS_ERR(addr))
+	{
+		printk("uefi_blockdev: memremap_pages failed %ld\n", PTR_ERR(addr));
+		return NULL;
+	}
+
+	dev->ramdisk_phys = start;
+	return addr;
+}
 
-static blk_status_t uefi_blockdev_request(struct blk_mq_hw_ctx * hctx, const struct blk_mq_queue_data * bd)
+static void uefi_blockdev_dax_add(uefi_blockdev_t * dev)
 {
-	struct request * rq = bd->rq;
-	uefi_blockdev_t * dev = rq->rq_disk->private_data;
-	struct bio_vec bvec;
-	struct req_iterator iter;
-	int status = 0;
+	struct gendisk * disk = dev->gd;
 
-	uefi_memory_map_add();
+	if (!dev->pgmap.type)
+		return;
 
-	if (blk_rq_is_passthrough(rq))
+	dev->dax_dev = alloc_dax(dev, disk->disk_name, &uefi_blockdev_dax_ops, 0);
+	if (!dev->dax_dev)
 	{
-		printk(KERN_NOTICE "skip non-fs request\n");
-		blk_mq_end_request(rq, BLK_STS_IOERR);
-		return BLK_STS_OK;
+		printk("%s: alloc_dax failed\n", disk->disk_name);
+		return;
 	}
 
-	rq_for_each_segment(bvec, rq, iter) {
-		// sector is *always* in Linux 512 blocks
-		sector_t sector = iter.iter.bi_sector;
-		size_t len = bvec.bv_len;
-		char * buffer = kmap_atomic(bvec.bv_page);
-		unsigned long offset = bvec.bv_offset;
-		const bool is_write = bio_data_dir(iter.bio);
-		const size_t bs = dev->uefi_bio->Media->BlockSize;
-		const unsigned long disk_addr = sector * 512;
-		const unsigned long disk_sector = disk_addr / bs;
-
-		void * dest = buffer + offset;
-
-		// how many full blocks do we have?
-		size_t full_block_len = len & ~(bs - 1);
-		size_t partial_block_len = len - full_block_len;
-
-		// read and write have the same signature
-		EFI_BLOCK_READ handler = is_write
-			? dev->uefi_bio->WriteBlocks
-			: dev->uefi_bio->ReadBlocks;
-
-		if (debug)
-		printk("%s.%d: %s %08llx %08lx %08lx => %08llx + %08llx @ %08llx + %08llx\n",
-			dev->gd->disk_name,
-			dev->uefi_bio->Media->MediaId,
-			bio_data_dir(iter.bio) ? "WRITE" : "READ ",
-			sector,
-			disk_addr,
-			disk_sector,
-			(uint64_t) buffer,
-			(uint64_t) offset,
-			(uint64_t) full_block_len,
-			(uint64_t) partial_block_len
-		);
+	blk_queue_flag_set(QUEUE_FLAG_DAX, dev->queue);
+	printk("%s: dax enabled\n", disk->disk_name);
+}
+#endif
 
-		// do an operation on as many full blocks as we can
-		if (full_block_len != 0)
-			status |= handler(
-				dev->uefi_bio,
-				dev->uefi_bio->Media->MediaId,
-				disk_sector,
-				full_block_len,
-				dest
-			);
-
-		// and fix up any stragglers with our bounce buffer
-		if (partial_block_len != 0)
-		{
-			const size_t full_blocks = full_block_len / bs;
-			printk("tail %zu blocks + %zu bytes\n", full_blocks, partial_block_len);
+static void uefi_blockdev_group_release(struct kref * kref)
+{
+	kfree(container_of(kref, uefi_blockdev_group_t, kref));
+}
 
-			// pass through our block sized buffer
-			if (is_write)
-			{
-				printk("%s: short write %llx\n", dev->gd->disk_name, (uint64_t) partial_block_len);
-				memcpy(dev->buffer, dest, partial_block_len);
-			}
+// Release everything other than the gendisk and queue that
+// uefi_blockdev_add() allocated for the device.
+static void uefi_blockdev_free(uefi_blockdev_t * dev)
+{
+	uefi_blockdev_cache_drop(dev);
 
-			status |= handler(
-				dev->uefi_bio,
-				dev->uefi_bio->Media->MediaId,
-				disk_sector + full_blocks,
-				bs, // full block operation
-				dev->buffer
-			);
+	if (dev->group)
+		kref_put(&dev->group->kref, uefi_blockdev_group_release);
+	dev->group = NULL;
 
-			if (!is_write)
-			{
-				// copy the desired amount out of our buffer
-				memcpy(dest + full_block_len, dev->buffer, partial_block_len);
-			}
-		}
+	for(unsigned i = 0 ; i < dev->bounce_count ; i++)
+		free_pages((unsigned long) dev->bounce[i], dev->bounce_order);
+	dev->bounce_count = 0;
+	dev->buffer = NULL;
 
-		kunmap_atomic(buffer);
+#ifdef CONFIG_UEFIBLOCK_DAX
+	if (dev->pgmap.type)
+	{
+		memunmap_pages(&dev->pgmap);
+		dev->ramdisk = NULL;
 	}
+#endif
+	if (dev->ramdisk)
+		memunmap(dev->ramdisk);
+	dev->ramdisk = NULL;
 
-/* // todo: figure out what replaced this
-	// force writes if this is a barrier request
-	if (blk_barrier_rq(rq))
-		efi_call(dev->uefi_bio->FlushBlocks, dev->uefi_bio);
-*/
-
-	if (status)
-		printk("%s: operation failed %x\n", dev->gd->disk_name, status);
+	kfree(dev->devicepath);
+	dev->devicepath = NULL;
 
-	blk_mq_end_request(rq, status ? BLK_STS_IOERR : 0);
-	return BLK_STS_OK;
+	ida_simple_remove(&uefi_blockdev_ida, dev->index);
 }
 
-static struct blk_mq_ops uefi_blockdev_qops = {
-	.queue_rq	= uefi_blockdev_request,
-};
+// Find the last node of a device path before the end node, and
+// the length of the path up to and including it.
+static const EFI_DEVICE_PATH_PROTOCOL * uefi_blockdev_last_node(const EFI_DEVICE_PATH_PROTOCOL * dp, size_t * path_len)
+{
+	const EFI_DEVICE_PATH_PROTOCOL * const start = dp;
+	const EFI_DEVICE_PATH_PROTOCOL * last = NULL;
 
-static int uefi_blockdev_open(struct block_device * bd, fmode_t mode)
+	if (!dp)
+		return NULL;
+
+	while (dp->Type != END_DEVICE_PATH_TYPE)
+	{
+		const unsigned len = dp->Length[0] | dp->Length[1] << 8;
+		if (len < sizeof(*dp))
+			return NULL;
+
+		last = dp;
+		dp = (const void*) dp + len;
+	}
+
+	if (path_len)
+		*path_len = (const void*) dp - (const void*) start;
+
+	return last;
+}
+
+// If the last node of the device path describes a range of memory,
+// as it does for RAM disks, return the physical start and end of it.
+static int uefi_blockdev_memory_range(const EFI_DEVICE_PATH_PROTOCOL * dp, uint64_t * start, uint64_t * end)
 {
-	uefi_blockdev_t * const dev = bd->bd_disk->private_data;
-	atomic_inc(&dev->refcnt);
-	//printk("opened '%s'\n", bd->bd_disk->disk_name);
+	const EFI_DEVICE_PATH_PROTOCOL * last = uefi_blockdev_last_node(dp, NULL);
+
+	if (!last)
+		return -1;
+
+	if (last->Type == MEDIA_DEVICE_PATH && last->SubType == MEDIA_RAM_DISK_DP)
+	{
+		const MEDIA_RAM_DISK_DEVICE_PATH * ram = (const void*) last;
+		*start = ram->StartingAddr[0] | (uint64_t) ram->StartingAddr[1] << 32;
+		*end = ram->EndingAddr[0] | (uint64_t) ram->EndingAddr[1] << 32;
+	} else
+	if (last->Type == HARDWARE_DEVICE_PATH && last->SubType == HW_MEMMAP_DP)
+	{
+		const MEMMAP_DEVICE_PATH * mem = (const void*) last;
+		*start = mem->StartingAddress;
+		*end = mem->EndingAddress;
+	} else
+		return -1;
+
+	// the end address is inclusive
+	*end += 1;
 	return 0;
 }
 
-static void uefi_blockdev_release(struct gendisk * disk, fmode_t mode)
+// Add the UEFI attributes to a Linux partition if it doesn't have
+// them.  Rescanning the partition table (BLKRRPART, or a media change)
+// deletes and recreates the partitions, along with their sysfs
+// directories, so this is also done again after every scan.
+static void uefi_blockdev_part_attach(uefi_blockdev_t * parent, struct hd_struct * part)
 {
-	uefi_blockdev_t * const dev = disk->private_data;
-	atomic_dec(&dev->refcnt);
+	struct kobject * kobj = &part_to_dev(part)->kobj;
+	struct kernfs_node * kn = sysfs_get_dirent(kobj->sd, "uefi_handle");
+
+	if (kn)
+	{
+		sysfs_put(kn);
+		return;
+	}
+
+	for(struct attribute ** attr = uefi_blockdev_part_attrs ; *attr ; attr++)
+	{
+		if (sysfs_create_file(kobj, *attr) < 0)
+			printk("%sp%d: unable to create sysfs entry\n", parent->gd->disk_name, part->partno);
+	}
 }
 
-/* // todo: support removable media
-static int uefi_blockdev_media_changed(struct gendisk * gd)
+// UEFI partition handles duplicate what Linux finds when it scans
+// the whole disk, so rather than creating another block device for
+// them their handle and device path are attached to the matching
+// Linux partition.  Returns the parent disk if the handle has been
+// taken care of, or NULL if it needs a disk of its own.
+static uefi_blockdev_t * uefi_blockdev_alias(EFI_HANDLE handle, unsigned * partno_out)
 {
-	uefi_blockdev_t * const dev = gd->private_data;
-	return dev->uefi_bio->Media->MediaPresent;
+	EFI_DEVICE_PATH_PROTOCOL * const dp = uefi_device_path_dup(uefi_handle_protocol(&EFI_DEVICE_PATH_PROTOCOL_GUID, handle));
+	size_t path_len;
+	const EFI_DEVICE_PATH_PROTOCOL * last = uefi_blockdev_last_node(dp, &path_len);
+	const HARDDRIVE_DEVICE_PATH * hd = (const void*) last;
+	const size_t parent_len = path_len - (last ? last->Length[0] | last->Length[1] << 8 : 0);
+	uefi_blockdev_t * parent;
+	struct hd_struct * part;
+	unsigned partno;
+
+	if (!last
+	||  last->Type != MEDIA_DEVICE_PATH
+	||  last->SubType != MEDIA_HARDDRIVE_DP)
+		goto fail;
+
+	partno = hd->PartitionNumber;
+	if (partno == 0 || partno >= UEFI_BLOCKDEV_MINORS)
+		goto fail;
+
+	// the parent is the disk with the rest of the device path
+	list_for_each_entry(parent, &uefi_blockdev_list, list)
+	{
+		if (parent->devicepath_len == parent_len
+		&&  memcmp(parent->devicepath, dp, parent_len) == 0)
+			goto found;
+	}
+
+fail:
+	kfree(dp);
+	return NULL;
+
+found:
+	kfree(dp);
+	part = disk_get_part(parent->gd, partno);
+	if (!part)
+		return NULL;
+
+	parent->parts[partno].uefi_handle = handle;
+	parent->parts[partno].devicepath_string = kstrdup(uefi_device_path_to_name(handle), GFP_KERNEL);
+	uefi_blockdev_part_attach(parent, part);
+
+	printk("%sp%d: %s\n", parent->gd->disk_name, partno, parent->parts[partno].devicepath_string);
+	disk_put_part(part);
+
+	*partno_out = partno;
+	return parent;
 }
-*/
 
-/* // todo: support ioctl
-static int uefi_blockdev_ioctl(struct inode * inode, struct file * filp, unsigned int cmd, unsigned long arg)
+static void uefi_blockdev_unalias(uefi_blockdev_t * parent, unsigned partno)
 {
-	uefi_blockdev_t * const dev = inode->i_bdev->bd_disk->private_data;
-	struct hd_geometry geo = {
-		.heads = 4,
-		.sectors = 16,
-		.start = 0,
-		.cylinders = dev->uefi_bio->Media->LastBlock / 4 / 16,
-	};
+	struct hd_struct * part = disk_get_part(parent->gd, partno);
 
-	switch(cmd) {
-	case HDIO_GETGEO:
-		if (copy_to_user((void __user *) arg, &geo, sizeof(geo)))
-			return -EFAULT;
-		return 0;
+	// the partition might have gone away if the table was rewritten
+	if (part)
+	{
+		for(struct attribute ** attr = uefi_blockdev_part_attrs ; *attr ; attr++)
+			sysfs_remove_file(&part_to_dev(part)->kobj, *attr);
+		disk_put_part(part);
 	}
 
-	return -ENOTTY;
+	kfree(parent->parts[partno].devicepath_string);
+	parent->parts[partno].devicepath_string = NULL;
+	parent->parts[partno].uefi_handle = NULL;
 }
-*/
 
+// If the new device is a partition of an existing disk, or the other
+// way around, they see the same sectors and writes to one have to
+// drop the other's cache.  RAM disks are written without going
+// through the worker, so anything over one of them isn't cached.
+static void uefi_blockdev_group_add(uefi_blockdev_t * dev)
+{
+	uefi_blockdev_t * other;
 
-static struct block_device_operations uefi_blockdev_fops = {
-	.owner		= THIS_MODULE,
-	.open		= uefi_blockdev_open,
-	.release	= uefi_blockdev_release,
-	// .ioctl		= uefi_blockdev_ioctl,
-	// .media_changed	= uefi_blockdev_media_changed,
-};
+	if (!dev->devicepath || dev->devicepath_len == 0)
+		return;
 
+	list_for_each_entry(other, &uefi_blockdev_list, list)
+	{
+		const size_t len = min(dev->devicepath_len, other->devicepath_len);
 
-static ssize_t sysfs_devpath_show(struct device * dev, struct device_attribute * attr, char * buf)
-{
-	struct gendisk * disk = dev_to_disk(dev);
-	uefi_blockdev_t * uefi = disk->private_data;
-	sprintf(buf, "%s\n", uefi->devicepath_string);
-	return strlen(buf);
+		if (!other->devicepath
+		||  other->devicepath_len == 0
+		||  other->devicepath_len == dev->devicepath_len
+		||  memcmp(dev->devicepath, other->devicepath, len) != 0)
+			continue;
+
+		if (other->ramdisk)
+			dev->cache_max = 0;
+		if (dev->ramdisk)
+			WRITE_ONCE(other->cache_max, 0);
+
+		if (!other->group)
+		{
+			uefi_blockdev_group_t * group = kzalloc(sizeof(*group), GFP_KERNEL);
+			if (!group)
+				return;
+			kref_init(&group->kref);
+			WRITE_ONCE(other->group, group);
+		}
+
+		kref_get(&other->group->kref);
+		dev->group = other->group;
+		return;
+	}
 }
 
-static ssize_t sysfs_handle_show(struct device * dev, struct device_attribute * attr, char * buf)
+// Take a copy of the media details, which live in UEFI memory and
+// so can only be read while the firmware is mapped.
+static int uefi_blockdev_media(EFI_BLOCK_IO_PROTOCOL * uefi_bio, EFI_BLOCK_IO_MEDIA * media, UINT64 * revision)
 {
-	struct gendisk * disk = dev_to_disk(dev);
-	uefi_blockdev_t * uefi = disk->private_data;
-	sprintf(buf, "0x%016llx\n", (uint64_t) uefi->uefi_handle);
-	return strlen(buf);
-}
+	unsigned long flags;
 
-static DEVICE_ATTR(uefi_devicepath, 0444, sysfs_devpath_show, NULL);
-static DEVICE_ATTR(uefi_handle, 0444, sysfs_handle_show, NULL);
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
 
-struct attribute * uefi_blockdev_attrs[] = {
-	&dev_attr_uefi_devicepath.attr,
-	&dev_attr_uefi_handle.attr,
-	NULL,
-};
+	*media = *uefi_bio->Media;
+	if (revision)
+		*revision = uefi_bio->Revision;
 
+	uefi_firmware_exit(flags);
+	return 0;
+}
 
-static void * uefi_blockdev_add(int minor, EFI_HANDLE handle, EFI_BLOCK_IO_PROTOCOL * uefi_bio)
+static uefi_blockdev_t * uefi_blockdev_add(EFI_HANDLE handle, EFI_BLOCK_IO_PROTOCOL * uefi_bio)
 {
-	const EFI_BLOCK_IO_MEDIA * const media = uefi_bio->Media;
+	EFI_BLOCK_IO_MEDIA media_copy;
+	const EFI_BLOCK_IO_MEDIA * const media = &media_copy;
+	UINT64 revision;
 	struct gendisk * disk;
 	struct kobject * disk_kobj;
 	uefi_blockdev_t * dev;
 	void * fs;
+	uint64_t ram_start, ram_end;
 	const char * devpath = uefi_device_path_to_name(handle);
+	const int minor = ida_simple_get(&uefi_blockdev_ida, 0, (1 << MINORBITS) / UEFI_BLOCKDEV_MINORS, GFP_KERNEL);
+
+	if (minor < 0)
+		return NULL;
 
 	printk("uefi%d: %s\n", minor, devpath);
 
+	if (uefi_blockdev_media(uefi_bio, &media_copy, &revision) < 0)
+		goto fail_alloc;
+
 	fs = uefi_handle_protocol(&EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID, handle);
 	printk("uefi%d: rev=%llx id=%d removable=%d present=%d logical=%d ro=%d caching=%d bs=%u size=%llu%s\n",
 		minor,
-		uefi_bio->Revision,
+		revision,
 		media->MediaId,
 		media->RemovableMedia,
 		media->MediaPresent,
@@ -244,50 +1813,184 @@ static void * uefi_blockdev_add(int minor, EFI_HANDLE handle, EFI_BLOCK_IO_PROTO
 		media->ReadOnly,
 		media->WriteCaching,
 		media->BlockSize,
-		media->LastBlock * media->BlockSize,
+		(media->LastBlock + 1) * media->BlockSize,
 		fs ? " SIMPLE_FS" : "");
 
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev)
-		return NULL;
+		goto fail_alloc;
 
+	dev->index = minor;
 	spin_lock_init(&dev->lock);
-	atomic_set(&dev->refcnt, 0);
+	atomic_set(&dev->refcnt, 1); // released by uefi_blockdev_remove()
+	hash_init(dev->cache_hash);
+	INIT_LIST_HEAD(&dev->cache_lru);
 	dev->uefi_bio = uefi_bio;
-	dev->buffer = kzalloc(media->BlockSize, GFP_KERNEL);
+	dev->block_size = media->BlockSize;
+	dev->media_id = dev->cache_media_id = media->MediaId;
+	dev->media_present = media->MediaPresent;
+	dev->removable = media->RemovableMedia;
+	if (blockio2)
+		dev->uefi_bio2 = uefi_handle_protocol(&EFI_BLOCK_IO2_PROTOCOL_GUID, handle);
+	if (dev->uefi_bio2)
+		printk("uefi%d: using BlockIo2\n", minor);
+
+	dev->uefi_diskio = uefi_handle_protocol(&EFI_DISK_IO_PROTOCOL_GUID, handle);
+
+	dev->devicepath = uefi_device_path_dup(uefi_handle_protocol(&EFI_DEVICE_PATH_PROTOCOL_GUID, handle));
+	uefi_blockdev_last_node(dev->devicepath, &dev->devicepath_len);
+
+	if (uefi_blockdev_memory_range(dev->devicepath, &ram_start, &ram_end) == 0
+	&&  ram_end - ram_start >= (media->LastBlock + 1) * media->BlockSize)
+	{
+		dev->ramdisk_size = ram_end - ram_start;
+		dev->ramdisk_ro = media->ReadOnly;
+#ifdef CONFIG_UEFIBLOCK_DAX
+		dev->ramdisk = uefi_blockdev_dax_map(dev, ram_start, dev->ramdisk_size);
+		if (!dev->ramdisk)
+#endif
+		dev->ramdisk = memremap(ram_start, dev->ramdisk_size, MEMREMAP_WB);
+		if (dev->ramdisk)
+			printk("uefi%d: direct ramdisk %016llx + %zx\n", minor, ram_start, dev->ramdisk_size);
+	}
+
+	// the media in a RAM disk can't be swapped
+	if (dev->ramdisk)
+		dev->removable = false;
+
+	// stage as many whole blocks as will fit in the transfer buffers,
+	// in multiples of the firmware's preferred transfer size if it
+	// has told us one that is reasonable.
+	dev->buffer_size = max_t(size_t, rounddown(max(xfer_kb, 0) * 1024UL, media->BlockSize), media->BlockSize);
+	if (revision >= EFI_BLOCK_IO_PROTOCOL_REVISION3
+	&&  media->OptimalTransferLengthGranularity > 1)
+	{
+		const size_t granule = (size_t) media->BlockSize * media->OptimalTransferLengthGranularity;
+		if (granule <= SZ_4M)
+			dev->buffer_size = roundup(dev->buffer_size, granule);
+	}
+	dev->buffer_size = roundup(max_t(size_t, dev->buffer_size, PAGE_SIZE), media->BlockSize);
+	dev->io_align = media->IoAlign > 1 ? media->IoAlign : 1;
+
+	// the direct RAM disk path never stages anything
+	if (!dev->ramdisk && uefi_blockdev_bounce_alloc(dev) < 0)
+	{
+		printk("uefi%d: unable to allocate a %zu byte transfer buffer\n", minor, dev->buffer_size);
+		goto fail_bounce;
+	}
+
+	// RAM disks are already memory, so they do not need a cache
+	if (!dev->ramdisk)
+		dev->cache_max = (cache_kb * 1024) / media->BlockSize;
+
 	dev->uefi_handle = handle;
 	strncpy(dev->devicepath_string, devpath, sizeof(dev->devicepath_string));
 
 	//disk = dev->gd = blk_alloc_disk(0); // 5.15
-	disk = dev->gd = alloc_disk(1); // 5.4
+	// only whole disks are scanned for partitions
+	disk = dev->gd = alloc_disk(media->LogicalPartition ? 1 : UEFI_BLOCKDEV_MINORS); // 5.4
 	if (!disk)
-		return NULL;
+		goto fail_bounce;
 
 	sprintf(disk->disk_name, "uefi%d", minor);
 
 	disk->private_data	= dev;
 	disk->major		= major;
-	disk->first_minor	= minor;
-	disk->minors		= 1;
-	// todo: support removable media
-	//disk->flags		= media->RemovableMedia ? GENHD_FL_REMOVABLE : 0;
+	disk->first_minor	= minor * UEFI_BLOCKDEV_MINORS;
+	disk->minors		= media->LogicalPartition ? 1 : UEFI_BLOCKDEV_MINORS;
 	disk->fops		= &uefi_blockdev_fops;
 
+	// the block layer will ask check_events() about media changes
+	// when the disk is opened, and the sweep looks for them too.
+	if (dev->removable)
+	{
+		disk->flags		|= GENHD_FL_REMOVABLE;
+		disk->events		= DISK_EVENT_MEDIA_CHANGE;
+		disk->event_flags	= DISK_EVENT_FLAG_UEVENT;
+	}
+
 	dev->tag_set.ops	= &uefi_blockdev_qops;
-	dev->tag_set.nr_hw_queues = 1;
-	dev->tag_set.queue_depth = 128; // should be 1?
+	// a queue per CPU keeps the submitters from contending on a
+	// single hardware context; the worker feeds them all to the
+	// firmware in turn.  the depth bounds the BlockIo2 requests
+	// in flight, the synchronous ones wait on the pending list.
+	dev->tag_set.nr_hw_queues = hw_queues > 0 ? hw_queues : num_online_cpus();
+	dev->tag_set.queue_depth = clamp(queue_depth, 1, BLK_MQ_MAX_DEPTH);
 	dev->tag_set.numa_node	= NUMA_NO_NODE;
-	dev->tag_set.cmd_size	= 0;
+	dev->tag_set.cmd_size	= sizeof(uefi_blockdev_cmd_t);
 	dev->tag_set.flags	= BLK_MQ_F_SHOULD_MERGE;
 
-	blk_mq_alloc_tag_set(&dev->tag_set);
+	if (blk_mq_alloc_tag_set(&dev->tag_set) < 0)
+		goto fail_tag_set;
+
+	dev->queue = blk_mq_init_queue(&dev->tag_set);
+	if (IS_ERR(dev->queue))
+		goto fail_queue;
 
-	disk->queue = dev->queue = blk_mq_init_queue(&dev->tag_set);
+	disk->queue = dev->queue;
 	dev->queue->queuedata = dev;
 
-	blk_queue_logical_block_size(dev->queue, media->BlockSize);
-	set_capacity(disk, media->LastBlock * (media->BlockSize / 512)); // in Linux sectors
+	// large block media like CD-ROMs can present normal 512 byte
+	// sectors.  DiskIo handles the partial blocks if it is there,
+	// otherwise they are read-modify-write in the staging buffer.
+	if (subblock && media->BlockSize > 512)
+	{
+		blk_queue_logical_block_size(dev->queue, 512);
+		blk_queue_physical_block_size(dev->queue, media->BlockSize);
+	} else
+		blk_queue_logical_block_size(dev->queue, media->BlockSize);
+
+	// let the block layer know what the firmware prefers, so that
+	// most requests can be passed straight through without bouncing
+	if (dev->io_align > 1)
+		blk_queue_dma_alignment(dev->queue, dev->io_align - 1);
+
+	if (revision >= EFI_BLOCK_IO_PROTOCOL_REVISION2
+	&&  media->LogicalBlocksPerPhysicalBlock > 1)
+	{
+		const unsigned pbs = media->BlockSize * media->LogicalBlocksPerPhysicalBlock;
+		blk_queue_physical_block_size(dev->queue, pbs);
+		blk_queue_io_min(dev->queue, pbs);
+		blk_queue_alignment_offset(dev->queue, (media->LowestAlignedLba * media->BlockSize) % pbs);
+	}
 
+	if (revision >= EFI_BLOCK_IO_PROTOCOL_REVISION3
+	&&  media->OptimalTransferLengthGranularity > 1)
+		blk_queue_io_opt(dev->queue, media->BlockSize * media->OptimalTransferLengthGranularity);
+
+	// make the requests as large as the transfer buffer, so that
+	// each one is a single firmware call whether it is staged or
+	// not, and there is no hardware limit on the segments since
+	// they are copied by the CPU.  RAM disks can take anything.
+	if (dev->ramdisk)
+		blk_queue_max_hw_sectors(dev->queue, UINT_MAX);
+	else
+		blk_queue_max_hw_sectors(dev->queue, dev->buffer_size >> SECTOR_SHIFT);
+	blk_queue_max_segments(dev->queue, USHRT_MAX);
+	blk_queue_max_segment_size(dev->queue, max_t(size_t, dev->buffer_size, BLK_MAX_SEGMENT_SIZE));
+
+	// read far enough ahead that sequential reads of large files
+	// keep the firmware busy with full sized transfers
+	dev->queue->backing_dev_info->ra_pages = (readahead_kb > 0
+		? readahead_kb * 1024UL
+		: 2 * dev->buffer_size) / PAGE_SIZE;
+
+	// flushes are sent to FlushBlocks, and FUA writes are
+	// followed by one before they are completed.
+	blk_queue_write_cache(dev->queue, media->WriteCaching, media->WriteCaching);
+
+	// LastBlock is the last LBA, not the count of them
+	if (media->MediaPresent)
+		set_capacity(disk, (media->LastBlock + 1) * (media->BlockSize / 512)); // in Linux sectors
+
+#ifdef CONFIG_UEFIBLOCK_DAX
+	uefi_blockdev_dax_add(dev);
+#endif
+
+	// before any I/O, since add_disk() reads the partition table
+	uefi_blockdev_group_add(dev);
+
+	// add_disk() also scans the partition table
 	add_disk(disk);
 
 	// try to create the sysfs files once add_disk() has created
@@ -303,59 +2006,285 @@ static void * uefi_blockdev_add(int minor, EFI_HANDLE handle, EFI_BLOCK_IO_PROTO
 		}
 	}
 
+	if (sysfs_create_group(disk_kobj, &uefi_blockdev_stats_group) < 0)
+		printk("%s: unable to create sysfs stats\n", disk->disk_name);
+
+	// debugfs failures are not worth reporting
+	dev->debugfs = debugfs_create_dir(disk->disk_name, uefi_debugfs);
+	debugfs_create_file("read_latency", 0444, dev->debugfs, dev, &read_latency_fops);
+	debugfs_create_file("write_latency", 0444, dev->debugfs, dev, &write_latency_fops);
+
+	list_add_tail(&dev->list, &uefi_blockdev_list);
 
 	return dev;
+
+fail_queue:
+	blk_mq_free_tag_set(&dev->tag_set);
+fail_tag_set:
+	put_disk(disk);
+fail_bounce:
+	uefi_blockdev_free(dev);
+	kfree(dev);
+	return NULL;
+
+fail_alloc:
+	ida_simple_remove(&uefi_blockdev_ida, minor);
+	return NULL;
 }
 
-static int uefi_blockdev_handle_done(EFI_HANDLE handle)
+// The handle has gone away, so tear down the block device.  Anyone
+// that still has it open will get errors until they close it.
+static void uefi_blockdev_remove(uefi_blockdev_t * dev)
 {
-	static EFI_HANDLE handles_done[64];
-	static int handles_done_count;
+	struct gendisk * disk = dev->gd;
+
+	printk("%s: removing %s\n", disk->disk_name, dev->devicepath_string);
+
+	// the handle's protocols are no longer valid, so anything that
+	// is queued or still arrives fails without calling them.
+	WRITE_ONCE(dev->dead, true);
+	wake_up(&uefi_blockdev_wait);
 
-	for(unsigned i = 0 ; i < handles_done_count ; i++)
+	list_del(&dev->list);
+
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+
+	for(unsigned partno = 1 ; partno < UEFI_BLOCKDEV_MINORS ; partno++)
+		if (dev->parts[partno].uefi_handle)
+			uefi_blockdev_unalias(dev, partno);
+
+#ifdef CONFIG_UEFIBLOCK_DAX
+	if (dev->dax_dev)
 	{
-		if (handles_done[i] == handle)
-			return 1;
+		kill_dax(dev->dax_dev);
+		put_dax(dev->dax_dev);
+		dev->dax_dev = NULL;
 	}
+#endif
 
-	// this one is new, add it to our lsit
-	handles_done[handles_done_count++] = handle;
-	return 0;
+	// this waits for the worker to finish any requests in progress
+	del_gendisk(disk);
+	blk_cleanup_queue(dev->queue);
+	blk_mq_free_tag_set(&dev->tag_set);
+
+	uefi_blockdev_free(dev);
+
+	// one for alloc_disk() and one for get_disk_and_module()
+	put_disk_and_module(disk);
+	put_disk(disk);
+
+	uefi_blockdev_put(dev);
 }
 
-// called when there is a new block device driver registered
-// it unfortunately finds all of them.
-static void uefi_blockdev_scan(void * unused)
+static uefi_blockdev_handle_t * uefi_blockdev_lookup(EFI_HANDLE handle)
 {
-	EFI_HANDLE handles[64];
-	int handle_count = uefi_locate_handles(&EFI_BLOCK_IO_PROTOCOL_GUID, handles, 64);
-	int count = 0;
+	uefi_blockdev_handle_t * entry;
 
-	if (handle_count < 1)
-		return;
+	hash_for_each_possible(uefi_blockdev_handles, entry, hash, (unsigned long) handle)
+	{
+		if (entry->handle == handle)
+			return entry;
+	}
+
+	return NULL;
+}
+
+// Drop a handle from the registry, along with the block device or
+// partition alias that was made for it.
+static void uefi_blockdev_forget(uefi_blockdev_handle_t * entry)
+{
+	if (entry->dev)
+	{
+		// the aliases for its partitions go with it
+		uefi_blockdev_handle_t * other;
+		struct hlist_node * tmp;
+		unsigned bkt;
+
+		hash_for_each_safe(uefi_blockdev_handles, bkt, tmp, other, hash)
+		{
+			if (other->parent != entry->dev)
+				continue;
+			hash_del(&other->hash);
+			kfree(other);
+		}
+
+		uefi_blockdev_remove(entry->dev);
+	}
+
+	if (entry->parent)
+		uefi_blockdev_unalias(entry->parent, entry->partno);
+
+	hash_del(&entry->hash);
+	kfree(entry);
+}
+
+// Add a disk or partition alias for a handle that has not been seen
+// before, or that has had its BlockIo reinstalled.  The partitions are
+// skipped on the first pass so that their parents are there already.
+// Returns 1 if a new block device was created.
+static int uefi_blockdev_probe(EFI_HANDLE handle, bool partitions)
+{
+	EFI_BLOCK_IO_PROTOCOL * uefi_bio = uefi_handle_protocol(&EFI_BLOCK_IO_PROTOCOL_GUID, handle);
+	EFI_BLOCK_IO_MEDIA media;
+	uefi_blockdev_handle_t * entry;
+
+	if (uefi_bio && uefi_blockdev_media(uefi_bio, &media, NULL) < 0)
+		return 0;
+	if (uefi_bio && !!media.LogicalPartition != partitions)
+		return 0;
+
+	// have we seen this one?
+	entry = uefi_blockdev_lookup(handle);
+	if (entry && entry->uefi_bio == uefi_bio)
+		return 0;
+	if (entry)
+		uefi_blockdev_forget(entry);
+	if (!uefi_bio)
+		return 0;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return 0;
+
+	entry->handle = handle;
+	entry->uefi_bio = uefi_bio;
 
-	for(unsigned i = 0 ; i < handle_count ; i++)
+	if (partitions && !partition_disks)
+		entry->parent = uefi_blockdev_alias(handle, &entry->partno);
+	if (!entry->parent)
+		entry->dev = uefi_blockdev_add(handle, uefi_bio);
+
+	// failures are remembered too, so they are not retried every time
+	hash_add(uefi_blockdev_handles, &entry->hash, (unsigned long) handle);
+
+	return entry->dev ? 1 : 0;
+}
+
+// Put the attributes back on any aliased partitions that have been
+// recreated since the last time they were checked.
+static void uefi_blockdev_reattach(void)
+{
+	uefi_blockdev_handle_t * entry;
+	unsigned bkt;
+
+	hash_for_each(uefi_blockdev_handles, bkt, entry, hash)
 	{
-		EFI_HANDLE handle = handles[i];
-		EFI_BLOCK_IO_PROTOCOL * uefi_bio;
+		struct hd_struct * part;
 
-		// have we seen this one?
-		if (uefi_blockdev_handle_done(handle))
+		if (!entry->parent)
 			continue;
-				
-		uefi_bio = uefi_handle_protocol(
-			&EFI_BLOCK_IO_PROTOCOL_GUID,
-			handle
-		);
 
-		if (!uefi_bio)
+		part = disk_get_part(entry->parent->gd, entry->partno);
+		if (!part)
 			continue;
 
-		uefi_blockdev_add(i, handle, uefi_bio);
-		count++;
+		uefi_blockdev_part_attach(entry->parent, part);
+		disk_put_part(part);
+	}
+}
+
+// Remove the devices for any handles that no longer have BlockIo.
+// The firmware doesn't tell us when a protocol is uninstalled, so
+// this has to check all of them.
+static void uefi_blockdev_sweep_handles(void)
+{
+	uefi_blockdev_handle_t * entry;
+	struct hlist_node * tmp;
+	unsigned bkt;
+
+restart:
+	hash_for_each_safe(uefi_blockdev_handles, bkt, tmp, entry, hash)
+	{
+		if (uefi_handle_protocol(&EFI_BLOCK_IO_PROTOCOL_GUID, entry->handle) == entry->uefi_bio)
+			continue;
+
+		// removing a disk also removes its partitions' entries,
+		// which might include the next one in this walk
+		uefi_blockdev_forget(entry);
+		goto restart;
+	}
+}
+
+static void uefi_blockdev_sweep(struct work_struct * work);
+static DECLARE_DELAYED_WORK(uefi_blockdev_sweep_work, uefi_blockdev_sweep);
+
+static void uefi_blockdev_sweep(struct work_struct * work)
+{
+	uefi_blockdev_t * dev;
+
+	mutex_lock(&uefi_blockdev_mutex);
+	uefi_blockdev_sweep_handles();
+	uefi_blockdev_reattach();
+
+	// let userspace know that the stick has been swapped, the
+	// block layer will revalidate it the next time it is opened.
+	list_for_each_entry(dev, &uefi_blockdev_list, list)
+	{
+		char * envp[] = { "DISK_MEDIA_CHANGE=1", NULL };
+
+		if (dev->media_changed || !uefi_blockdev_media_probe(dev))
+			continue;
+
+		kobject_uevent_env(&disk_to_dev(dev->gd)->kobj, KOBJ_CHANGE, envp);
+	}
+
+	mutex_unlock(&uefi_blockdev_mutex);
+
+	if (sweep_ms > 0)
+		schedule_delayed_work(&uefi_blockdev_sweep_work, msecs_to_jiffies(sweep_ms));
+}
+
+// called when there is a new block device driver registered.
+// the first time every handle is checked, after that only the
+// ones that the firmware says are new since the last time.
+static void uefi_blockdev_scan(void * unused)
+{
+	EFI_HANDLE * handles = NULL;
+	int handle_count = 0;
+	int count = 0;
+
+	if (!uefi_blockdev_scanned)
+	{
+		handles = uefi_locate_all_handles(&EFI_BLOCK_IO_PROTOCOL_GUID, &handle_count);
+		uefi_blockdev_scanned = true;
+	} else {
+		EFI_HANDLE handle;
+		int handle_max = 0;
+
+		while ((handle = uefi_locate_notify_handle(uefi_blockdev_registration)) != NULL)
+		{
+			if (handle_count == handle_max)
+			{
+				EFI_HANDLE * new_handles;
+				handle_max = handle_max ? 2 * handle_max : 16;
+				new_handles = krealloc(handles, handle_max * sizeof(*handles), GFP_KERNEL);
+				if (!new_handles)
+					break;
+				handles = new_handles;
+			}
+
+			handles[handle_count++] = handle;
+		}
 	}
 
-	printk("uefi_blockdev: created %d block devices\n", count);
+	mutex_lock(&uefi_blockdev_mutex);
+
+	// whole disks first, so that the partitions can find their parent
+	for(unsigned pass = 0 ; pass < 2 ; pass++)
+		for(unsigned i = 0 ; i < handle_count ; i++)
+			count += uefi_blockdev_probe(handles[i], pass);
+
+	// a reinstalled protocol might have replaced another one
+	uefi_blockdev_sweep_handles();
+	uefi_blockdev_reattach();
+
+	mutex_unlock(&uefi_blockdev_mutex);
+
+	kfree(handles);
+
+	if (count)
+		printk("uefi_blockdev: created %d block devices\n", count);
 }
 
 
@@ -364,7 +2293,8 @@ static int uefi_blockdev_register(void)
 	uefi_register_protocol_callback(
 		&EFI_BLOCK_IO_PROTOCOL_GUID,
 		uefi_blockdev_scan,
-		NULL
+		NULL,
+		&uefi_blockdev_registration
 	);
 	return 0;
 }
@@ -375,6 +2305,22 @@ int uefi_blockdev_init(void)
 	if (major < 0)
 		return -EIO;
 
+	// asynchronous BlockIo2 requests only complete if we can
+	// drive the firmware timer ourselves
+	if (blockio2 && uefi_timer_tick() != 0)
+	{
+		printk("uefi_blockdev: no soft timer interrupt, not using BlockIo2\n");
+		blockio2 = 0;
+	}
+
+	// the firmware expects to be called from the boot processor
+	uefi_blockdev_thread = kthread_create(uefi_blockdev_worker, NULL, "uefi_blockio");
+	if (IS_ERR(uefi_blockdev_thread))
+		return -EIO;
+
+	kthread_bind(uefi_blockdev_thread, 0);
+	wake_up_process(uefi_blockdev_thread);
+
 /*
 	if (uefi_blockdev_scan() < 0)
 		return -EIO;
@@ -384,5 +2330,8 @@ int uefi_blockdev_init(void)
 	if (uefi_blockdev_register() < 0)
 		return -EIO;
 
+	if (sweep_ms > 0)
+		schedule_delayed_work(&uefi_blockdev_sweep_work, msecs_to_jiffies(sweep_ms));
+
 	return 0;
 }
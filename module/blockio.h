@@ -92,4 +92,96 @@ typedef struct _EFI_BLOCK_IO_PROTOCOL {
 typedef struct _EFI_BLOCK_IO_PROTOCOL _EFI_BLOCK_IO;
 typedef EFI_BLOCK_IO_PROTOCOL EFI_BLOCK_IO;
 
+
+//
+// Block IO2 protocol, with asynchronous token based transfers
+//
+#define EFI_BLOCK_IO2_PROTOCOL_GUID EFI_GUID(0xa77b2472, 0xe282, 0x4e9f,  0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1)
+
+struct _EFI_BLOCK_IO2_PROTOCOL;
+
+typedef struct {
+    EFI_EVENT               Event;
+    UINTN                   TransactionStatus; // EFI_STATUS is natively 64-bit
+} EFI_BLOCK_IO2_TOKEN;
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_BLOCK_RESET_EX) (
+    IN struct _EFI_BLOCK_IO2_PROTOCOL *This,
+    IN BOOLEAN                        ExtendedVerification
+    );
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_BLOCK_READ_EX) (
+    IN struct _EFI_BLOCK_IO2_PROTOCOL *This,
+    IN UINT32                         MediaId,
+    IN EFI_LBA                        LBA,
+    IN OUT EFI_BLOCK_IO2_TOKEN        *Token,
+    IN UINTN                          BufferSize,
+    OUT VOID                          *Buffer
+    );
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_BLOCK_WRITE_EX) (
+    IN struct _EFI_BLOCK_IO2_PROTOCOL *This,
+    IN UINT32                         MediaId,
+    IN EFI_LBA                        LBA,
+    IN OUT EFI_BLOCK_IO2_TOKEN        *Token,
+    IN UINTN                          BufferSize,
+    IN VOID                           *Buffer
+    );
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_BLOCK_FLUSH_EX) (
+    IN struct _EFI_BLOCK_IO2_PROTOCOL *This,
+    IN OUT EFI_BLOCK_IO2_TOKEN        *Token
+    );
+
+typedef struct _EFI_BLOCK_IO2_PROTOCOL {
+    EFI_BLOCK_IO_MEDIA      *Media;
+
+    EFI_BLOCK_RESET_EX      Reset;
+    EFI_BLOCK_READ_EX       ReadBlocksEx;
+    EFI_BLOCK_WRITE_EX      WriteBlocksEx;
+    EFI_BLOCK_FLUSH_EX      FlushBlocksEx;
+} EFI_BLOCK_IO2_PROTOCOL;
+
+
+//
+// Disk IO protocol, for byte granular access on top of Block IO
+//
+#define EFI_DISK_IO_PROTOCOL_GUID EFI_GUID(0xce345171, 0xba0b, 0x11d2,  0x8e, 0x4f, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b)
+
+struct _EFI_DISK_IO_PROTOCOL;
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_DISK_READ) (
+    IN struct _EFI_DISK_IO_PROTOCOL   *This,
+    IN UINT32                         MediaId,
+    IN UINT64                         Offset,
+    IN UINTN                          BufferSize,
+    OUT VOID                          *Buffer
+    );
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_DISK_WRITE) (
+    IN struct _EFI_DISK_IO_PROTOCOL   *This,
+    IN UINT32                         MediaId,
+    IN UINT64                         Offset,
+    IN UINTN                          BufferSize,
+    IN VOID                           *Buffer
+    );
+
+typedef struct _EFI_DISK_IO_PROTOCOL {
+    UINT64                  Revision;
+    EFI_DISK_READ           ReadDisk;
+    EFI_DISK_WRITE          WriteDisk;
+} EFI_DISK_IO_PROTOCOL;
+
 #endif
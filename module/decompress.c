@@ -0,0 +1,432 @@
+/* Compressed image reader
+ *
+ * RAM disk images compress very well, and reading them from a slow
+ * firmware block device is most of the time it takes to create the
+ * ramdisk.  The kernel's streaming decompressors write straight into
+ * the UEFI buffer, which grows as needed since the output size isn't
+ * known until the end.
+ *
+ * The lib/decompress_*.c wrappers are all __init, so this uses the
+ * xz_dec, zlib and zstd stream interfaces directly.
+ */
+#include <linux/kernel.h>
+#include <linux/sched/signal.h>
+#include <linux/fs.h>
+#include <linux/fadvise.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#include "efiwrapper.h"
+
+#ifdef CONFIG_UEFIRAMDISK_GZIP
+#include <linux/zlib.h>
+#endif
+#ifdef CONFIG_UEFIRAMDISK_XZ
+#include <linux/xz.h>
+#endif
+#ifdef CONFIG_UEFIRAMDISK_ZSTD
+#include <linux/zstd.h>
+#endif
+
+// compressed input is read this much at a time, and the output
+// buffer always has at least this much room for each step
+#define UEFI_DECOMPRESS_CHUNK	(1 << 20)
+
+typedef struct {
+	const char * name;
+	const uint8_t * magic;
+	size_t magic_len;
+
+	// returns the length of any header it consumed
+	int (*init)(void ** state, const uint8_t * in, size_t in_size);
+
+	// the uncompressed size if the format records it, or 0
+	size_t (*size)(struct file * file, loff_t file_size, const uint8_t * in, size_t in_size);
+
+	// returns 1 at the end of the stream, 0 if it needs more
+	int (*run)(void * state,
+		const uint8_t * in, size_t * in_pos, size_t in_size,
+		uint8_t * out, size_t * out_pos, size_t out_size);
+
+	void (*end)(void * state);
+} uefi_decompressor_t;
+
+
+#ifdef CONFIG_UEFIRAMDISK_GZIP
+// the kernel zlib only knows the zlib wrapper, so the gzip header
+// is skipped here and the deflate stream is inflated raw.
+// the trailing crc isn't checked.
+static int gzip_init(void ** state, const uint8_t * in, size_t in_size)
+{
+	z_stream * z;
+	uint8_t flags;
+	size_t off = 10;
+
+	if (in_size < off || in[2] != 8) // deflate
+		return -EINVAL;
+	flags = in[3];
+
+	if (flags & 0x04) // FEXTRA
+	{
+		if (in_size < off + 2)
+			return -EINVAL;
+		off += 2 + get_unaligned_le16(&in[off]);
+	}
+	if (flags & 0x08) // FNAME
+		while (off < in_size && in[off++] != '\0')
+			;
+	if (flags & 0x10) // FCOMMENT
+		while (off < in_size && in[off++] != '\0')
+			;
+	if (flags & 0x02) // FHCRC
+		off += 2;
+
+	if (off >= in_size)
+		return -EINVAL;
+
+	z = vzalloc(sizeof(*z));
+	if (!z)
+		return -ENOMEM;
+
+	z->workspace = vmalloc(zlib_inflate_workspacesize());
+	if (!z->workspace || zlib_inflateInit2(z, -MAX_WBITS) != Z_OK)
+	{
+		vfree(z->workspace);
+		vfree(z);
+		return -ENOMEM;
+	}
+
+	*state = z;
+	return off;
+}
+
+static int gzip_run(void * state,
+	const uint8_t * in, size_t * in_pos, size_t in_size,
+	uint8_t * out, size_t * out_pos, size_t out_size)
+{
+	z_stream * z = state;
+	int rc;
+
+	// the counts are only 32 bits, and the output buffer can be
+	// larger than that, so zlib is given as much as fits and the
+	// positions come from how far it got
+	z->next_in = in + *in_pos;
+	z->avail_in = min_t(size_t, in_size - *in_pos, UINT_MAX);
+	z->next_out = out + *out_pos;
+	z->avail_out = min_t(size_t, out_size - *out_pos, UINT_MAX);
+
+	rc = zlib_inflate(z, Z_NO_FLUSH);
+
+	*in_pos = z->next_in - in;
+	*out_pos = z->next_out - out;
+
+	if (rc == Z_STREAM_END)
+		return 1;
+	if (rc == Z_OK)
+		return 0;
+
+	printk("uefi_decompress: inflate failed %d\n", rc);
+	return -EINVAL;
+}
+
+static void gzip_end(void * state)
+{
+	z_stream * z = state;
+	zlib_inflateEnd(z);
+	vfree(z->workspace);
+	vfree(z);
+}
+
+// the trailer has the size mod 4 GiB, which is only a hint since
+// the image might be larger than that
+static size_t gzip_size(struct file * file, loff_t file_size, const uint8_t * in, size_t in_size)
+{
+	loff_t pos = file_size - 4;
+	__le32 isize;
+
+	if (file_size < 18 || kernel_read(file, &isize, sizeof(isize), &pos) != sizeof(isize))
+		return 0;
+
+	return le32_to_cpu(isize);
+}
+
+static const uint8_t gzip_magic[] = { 0x1F, 0x8B };
+#endif
+
+
+#ifdef CONFIG_UEFIRAMDISK_XZ
+static int xz_init(void ** state, const uint8_t * in, size_t in_size)
+{
+	// the dictionary is allocated as the stream header requires
+	struct xz_dec * xz = xz_dec_init(XZ_DYNALLOC, (uint32_t) -1);
+	if (!xz)
+		return -ENOMEM;
+
+	*state = xz;
+	return 0;
+}
+
+static int xz_run(void * state,
+	const uint8_t * in, size_t * in_pos, size_t in_size,
+	uint8_t * out, size_t * out_pos, size_t out_size)
+{
+	struct xz_buf b = {
+		.in		= in,
+		.in_pos		= *in_pos,
+		.in_size	= in_size,
+		.out		= out,
+		.out_pos	= *out_pos,
+		.out_size	= out_size,
+	};
+	enum xz_ret rc = xz_dec_run(state, &b);
+
+	*in_pos = b.in_pos;
+	*out_pos = b.out_pos;
+
+	if (rc == XZ_STREAM_END)
+		return 1;
+	if (rc == XZ_OK)
+		return 0;
+
+	printk("uefi_decompress: xz failed %d\n", rc);
+	return -EINVAL;
+}
+
+static void xz_end(void * state)
+{
+	xz_dec_end(state);
+}
+
+static const uint8_t xz_magic[] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+#endif
+
+
+#ifdef CONFIG_UEFIRAMDISK_ZSTD
+typedef struct {
+	ZSTD_DStream * zds;
+	void * workspace;
+} zstd_state_t;
+
+static int zstd_init(void ** state, const uint8_t * in, size_t in_size)
+{
+	ZSTD_frameParams params;
+	zstd_state_t * zstd;
+	size_t workspace_size;
+
+	if (ZSTD_getFrameParams(&params, in, in_size) != 0)
+		return -EINVAL;
+
+	zstd = vzalloc(sizeof(*zstd));
+	if (!zstd)
+		return -ENOMEM;
+
+	workspace_size = ZSTD_DStreamWorkspaceBound(params.windowSize);
+	zstd->workspace = vmalloc(workspace_size);
+	if (zstd->workspace)
+		zstd->zds = ZSTD_initDStream(params.windowSize, zstd->workspace, workspace_size);
+
+	if (!zstd->zds)
+	{
+		vfree(zstd->workspace);
+		vfree(zstd);
+		return -ENOMEM;
+	}
+
+	*state = zstd;
+	return 0;
+}
+
+static int zstd_run(void * state,
+	const uint8_t * in, size_t * in_pos, size_t in_size,
+	uint8_t * out, size_t * out_pos, size_t out_size)
+{
+	zstd_state_t * zstd = state;
+	ZSTD_inBuffer ib = { .src = in, .size = in_size, .pos = *in_pos };
+	ZSTD_outBuffer ob = { .dst = out, .size = out_size, .pos = *out_pos };
+	size_t rc = ZSTD_decompressStream(zstd->zds, &ob, &ib);
+
+	*in_pos = ib.pos;
+	*out_pos = ob.pos;
+
+	if (ZSTD_isError(rc))
+	{
+		printk("uefi_decompress: zstd failed %d\n", ZSTD_getErrorCode(rc));
+		return -EINVAL;
+	}
+
+	// only the first frame is used
+	return rc == 0;
+}
+
+// only there if the compressor knew the size when it started
+static size_t zstd_size(struct file * file, loff_t file_size, const uint8_t * in, size_t in_size)
+{
+	ZSTD_frameParams params;
+
+	if (ZSTD_getFrameParams(&params, in, in_size) != 0)
+		return 0;
+
+	return params.frameContentSize;
+}
+
+static void zstd_end(void * state)
+{
+	zstd_state_t * zstd = state;
+	vfree(zstd->workspace);
+	vfree(zstd);
+}
+
+static const uint8_t zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+#endif
+
+
+static const uefi_decompressor_t uefi_decompressors[] = {
+#ifdef CONFIG_UEFIRAMDISK_GZIP
+	{ "gzip", gzip_magic, sizeof(gzip_magic), gzip_init, gzip_size, gzip_run, gzip_end },
+#endif
+#ifdef CONFIG_UEFIRAMDISK_XZ
+	{ "xz", xz_magic, sizeof(xz_magic), xz_init, NULL, xz_run, xz_end },
+#endif
+#ifdef CONFIG_UEFIRAMDISK_ZSTD
+	{ "zstd", zstd_magic, sizeof(zstd_magic), zstd_init, zstd_size, zstd_run, zstd_end },
+#endif
+	{ NULL },
+};
+
+
+static const uefi_decompressor_t * uefi_decompressor(const uint8_t * in, size_t in_size)
+{
+	const uefi_decompressor_t * d;
+
+	for (d = uefi_decompressors ; d->name ; d++)
+	{
+		if (in_size >= d->magic_len && memcmp(in, d->magic, d->magic_len) == 0)
+			return d;
+	}
+
+	return NULL;
+}
+
+
+void * uefi_alloc_and_decompress_file(const char * filename_in, size_t * size_out, size_t align, uefi_progress_t * progress)
+{
+	const uefi_decompressor_t * d;
+	uefi_stream_t stream;
+	struct file * file;
+	loff_t file_size;
+	loff_t pos = 0;
+	uint8_t * in;
+	size_t in_pos;
+	ssize_t in_size;
+	size_t out_size;
+	void * state;
+	void * image = NULL;
+	char buf[256];
+	const char * name = uefi_filename_trim(buf, sizeof(buf), filename_in);
+	int rc;
+
+	file = filp_open(name, O_RDONLY, 0);
+	if (IS_ERR_OR_NULL(file))
+	{
+		printk("uefi_decompress: unable to open '%s'\n", name);
+		return NULL;
+	}
+
+	file_size = i_size_read(file_inode(file));
+
+	in = vmalloc(UEFI_DECOMPRESS_CHUNK);
+	if (!in)
+		goto fail_in;
+
+	in_size = kernel_read(file, in, UEFI_DECOMPRESS_CHUNK, &pos);
+	d = in_size > 0 ? uefi_decompressor(in, in_size) : NULL;
+	if (!d)
+	{
+		// not one that we know, so read it as is
+		vfree(in);
+		filp_close(file, NULL);
+		return uefi_alloc_and_read_file(name, size_out, align, progress);
+	}
+
+	// with the size known up front the output buffer never has to
+	// be grown, which would need twice the memory while it copies.
+	// there is always a chunk of room after the output.
+	out_size = d->size ? d->size(file, file_size, in, in_size) : 0;
+	printk("uefi_decompress: %s => %lld bytes %s, %zu uncompressed\n", name, file_size, d->name, out_size);
+
+	uefi_stream_init(&stream, align, out_size ? out_size + UEFI_DECOMPRESS_CHUNK : 0, progress);
+	if (progress)
+	{
+		// progress is through the compressed file
+		strlcpy(progress->filename, name, sizeof(progress->filename));
+		WRITE_ONCE(progress->size, file_size);
+		WRITE_ONCE(progress->done, pos);
+	}
+
+	rc = d->init(&state, in, in_size);
+	if (rc < 0)
+	{
+		printk("uefi_decompress: %s: bad %s header\n", name, d->name);
+		goto fail_init;
+	}
+
+	vfs_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+	in_pos = rc;
+
+	while (1)
+	{
+		size_t out_pos;
+
+		if (in_pos == in_size)
+		{
+			if (fatal_signal_pending(current))
+			{
+				printk("uefi_decompress: %s cancelled at %lld\n", name, pos);
+				goto fail_run;
+			}
+
+			in_size = kernel_read(file, in, UEFI_DECOMPRESS_CHUNK, &pos);
+			if (in_size <= 0)
+			{
+				printk("uefi_decompress: %s truncated at %lld\n", name, pos);
+				goto fail_run;
+			}
+
+			in_pos = 0;
+			if (progress)
+				WRITE_ONCE(progress->done, pos);
+			cond_resched();
+		}
+
+		if (uefi_stream_reserve(&stream, UEFI_DECOMPRESS_CHUNK) < 0)
+		{
+			printk("uefi_decompress: could not allocate %zu bytes\n", stream.size + UEFI_DECOMPRESS_CHUNK);
+			goto fail_run;
+		}
+
+		out_pos = stream.size;
+		rc = d->run(state, in, &in_pos, in_size, stream.mapped, &out_pos, stream.capacity);
+		stream.size = out_pos;
+
+		if (rc < 0)
+			goto fail_run;
+		if (rc == 1)
+			break;
+	}
+
+	image = uefi_stream_finish(&stream, size_out);
+	if (progress)
+		WRITE_ONCE(progress->done, *size_out);
+
+	printk("uefi_decompress: %s => %zu bytes\n", name, *size_out);
+
+fail_run:
+	d->end(state);
+fail_init:
+	if (!image)
+		uefi_stream_free(&stream);
+	vfree(in);
+fail_in:
+	filp_close(file, NULL);
+	return image;
+}
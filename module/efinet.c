@@ -15,7 +15,6 @@
 #include "efidhcp4.h"
 
 typedef struct {
-	spinlock_t lock;
 	EFI_SIMPLE_NETWORK_PROTOCOL * uefi_nic;
 	EFI_HANDLE uefi_handle;
 	int id;
@@ -48,10 +47,13 @@ static int uefi_net_rx(uefi_nic_t * nic)
 		skb_reserve(nic->rx_skb, NET_IP_ALIGN);
 	}
 
-	spin_lock_irqsave(&nic->lock, flags);
+	// another CPU is in the firmware, try again next time
+	if (uefi_firmware_try_enter(&flags) < 0)
+		return 0;
+
 	skb = nic->rx_skb;
 
-	status = nic->uefi_nic->Receive(
+	status = uefi_call("Receive", nic->uefi_nic->Receive,
 		nic->uefi_nic,
 		NULL, // header size, no processing required
 		&pkt_len,
@@ -66,7 +68,7 @@ static int uefi_net_rx(uefi_nic_t * nic)
 	if (status == 0)
 		nic->rx_skb = NULL;
 
-	spin_unlock_irqrestore(&nic->lock, flags);
+	uefi_firmware_exit(flags);
 
 	if (status == 6) // EFI_NOT_READY)
 	{
@@ -87,10 +89,12 @@ static int uefi_net_rx(uefi_nic_t * nic)
 	return 1;
 }
 
+// the NICs that lost carrier when the firmware died get it back
+// if the firmware does
+static bool uefi_net_stalled;
+
 static void uefi_net_poll(struct timer_list * timer)
 {
-	uefi_memory_map_add();
-
 	// try to clear the queues on the NICs
 	for(int loops = 0 ; loops < 10 ; loops++)
 	{
@@ -101,6 +105,25 @@ static void uefi_net_poll(struct timer_list * timer)
 			break;
 	}
 
+	// the watchdog has given up on the firmware, so the NICs
+	// aren't going to receive anything until the stuck call
+	// comes back.  check on it less often in the meantime.
+	if (uefi_firmware_is_dead())
+	{
+		for(int i = 0 ; i < uefi_nic_count ; i++)
+			netif_carrier_off(uefi_nics[i]->dev);
+		uefi_net_stalled = true;
+		mod_timer(timer, jiffies + HZ);
+		return;
+	}
+
+	if (uefi_net_stalled)
+	{
+		for(int i = 0 ; i < uefi_nic_count ; i++)
+			netif_carrier_on(uefi_nics[i]->dev);
+		uefi_net_stalled = false;
+	}
+
 	// reschedule our selves to check again
 	mod_timer(timer, jiffies + msecs_to_jiffies(5));
 }
@@ -109,11 +132,15 @@ static void uefi_net_poll(struct timer_list * timer)
 static int uefi_net_open(struct net_device * dev)
 {
 	uefi_nic_t * nic = netdev_priv(dev);
+	unsigned long flags;
 	int status;
 
-	uefi_memory_map_add();
+	status = uefi_firmware_enter(&flags);
+	if (status < 0)
+		return status;
 
-	status = nic->uefi_nic->Start(nic->uefi_nic);
+	status = uefi_call("Start", nic->uefi_nic->Start, nic->uefi_nic);
+	uefi_firmware_exit(flags);
 
 	// 0 == success, 20 == already started
 	if (status != 0 && status != 20)
@@ -131,13 +158,17 @@ static int uefi_net_open(struct net_device * dev)
 static int uefi_net_stop(struct net_device * dev)
 {
 	uefi_nic_t * nic = netdev_priv(dev);
+	unsigned long flags;
 	int status;
 
-	uefi_memory_map_add();
-
 	nic->up = 0; // we'll stop scheduling timers
 
-	status = nic->uefi_nic->Shutdown(nic->uefi_nic);
+	status = uefi_firmware_enter(&flags);
+	if (status < 0)
+		return status;
+
+	status = uefi_call("Shutdown", nic->uefi_nic->Shutdown, nic->uefi_nic);
+	uefi_firmware_exit(flags);
 	if (status != 0)
 	{
 		printk("uefi%d: stop returned %d\n", nic->id, status);
@@ -154,11 +185,19 @@ static netdev_tx_t uefi_net_xmit(struct sk_buff * skb, struct net_device * dev)
 	unsigned long flags;
 	int status;
 
-	uefi_memory_map_add();
+	// the stack will requeue it rather than wait for a disk transfer
+	if (uefi_firmware_try_enter(&flags) < 0)
+	{
+		if (!uefi_firmware_is_dead())
+			return NETDEV_TX_BUSY;
 
-	spin_lock_irqsave(&nic->lock, flags);
+		// retrying will never work, so drop it
+		nic->stats.tx_dropped++;
+		dev_kfree_skb_any(skb);
+		return NETDEV_TX_OK;
+	}
 
-	status = nic->uefi_nic->Transmit(
+	status = uefi_call("Transmit", nic->uefi_nic->Transmit,
 		nic->uefi_nic,
 		0,		// HeaderSize 0 == packet is fully formed
 		skb->len,	// BufferSize
@@ -168,7 +207,7 @@ static netdev_tx_t uefi_net_xmit(struct sk_buff * skb, struct net_device * dev)
 		NULL		// Protocol, unused
 	);
 
-	spin_unlock_irqrestore(&nic->lock, flags);
+	uefi_firmware_exit(flags);
 
 	dev_consume_skb_any(skb);
 
@@ -193,18 +232,19 @@ static struct net_device_stats * uefi_net_stats(struct net_device * dev)
 	UINTN uefi_stats_size = sizeof(uefi_stats);
 	unsigned long flags;
 
-	uefi_memory_map_add();
-
-	spin_lock_irqsave(&nic->lock, flags);
+	// this can be called in atomic context, so the last counters
+	// will do if the firmware is busy
+	if (uefi_firmware_try_enter(&flags) < 0)
+		return stats;
 
-	nic->uefi_nic->Statistics(
+	uefi_call("Statistics", nic->uefi_nic->Statistics,
 		nic->uefi_nic,
 		0, // do not reset
 		&uefi_stats_size,
 		&uefi_stats
 	);
 
-	spin_unlock_irqrestore(&nic->lock, flags);
+	uefi_firmware_exit(flags);
 
 	// translate the stats to Linux from UEFI
 	stats->rx_bytes		= uefi_stats.RxTotalBytes;
@@ -314,6 +354,8 @@ static void uefi_nic_autoconfig(uefi_nic_t * nic)
 {
 	EFI_DHCP4_PROTOCOL * dhcp4 = uefi_locate_and_handle_protocol(&EFI_DHCP4_PROTOCOL_GUID);
 	EFI_DHCP4_MODE_DATA config;
+	UINT32 nic_state;
+	unsigned long flags;
 	int status;
 
 	if (!dhcp4)
@@ -322,7 +364,12 @@ static void uefi_nic_autoconfig(uefi_nic_t * nic)
 		return;
 	}
 
-	status = dhcp4->GetModeData(dhcp4, &config);
+	if (uefi_firmware_enter(&flags) < 0)
+		return;
+
+	status = uefi_call("GetModeData", dhcp4->GetModeData, dhcp4, &config);
+	nic_state = nic->uefi_nic->Mode->State;
+	uefi_firmware_exit(flags);
 	if (status != 0)
 	{
 		printk("UEFI DHCP get mode failed? %d\n", status);
@@ -348,7 +395,7 @@ static void uefi_nic_autoconfig(uefi_nic_t * nic)
 		config.SubnetMask.Addr[1],
 		config.SubnetMask.Addr[2],
 		config.SubnetMask.Addr[3],
-		nic->uefi_nic->Mode->State
+		nic_state
 	);
 
 	uefi_nic_set_address(
@@ -363,6 +410,16 @@ static int uefi_nic_create(int id, EFI_HANDLE handle, EFI_SIMPLE_NETWORK_PROTOCO
 {
 	struct net_device * dev;
 	uefi_nic_t * nic;
+	EFI_SIMPLE_NETWORK_MODE mode;
+	unsigned long flags;
+
+	// the mode is in UEFI memory, so take a copy of it
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
+
+	mode = *uefi_nic->Mode;
+	uefi_firmware_exit(flags);
+
 	dev = alloc_etherdev(sizeof(uefi_nic_t));
 
 	if (!dev)
@@ -380,7 +437,6 @@ static int uefi_nic_create(int id, EFI_HANDLE handle, EFI_SIMPLE_NETWORK_PROTOCO
 
 	memset(nic, 0, sizeof(*nic));
 
-	spin_lock_init(&nic->lock);
 	nic->dev = dev;
 	nic->uefi_nic = uefi_nic;
 	nic->uefi_handle = handle;
@@ -388,15 +444,15 @@ static int uefi_nic_create(int id, EFI_HANDLE handle, EFI_SIMPLE_NETWORK_PROTOCO
 	nic->up = 0;
 	nic->rx_skb = NULL;
 
-	memcpy(dev->dev_addr, uefi_nic->Mode->CurrentAddress.Addr, ETH_ALEN);
+	memcpy(dev->dev_addr, mode.CurrentAddress.Addr, ETH_ALEN);
 	dev->netdev_ops = &uefi_nic_ops;
 
 	register_netdevice(dev);
 
 	printk("%d: type=%d media=%d addr=%02x:%02x:%02x:%02x:%02x:%02x\n",
 		nic->id,
-		uefi_nic->Mode->IfType,
-		uefi_nic->Mode->MediaPresent,
+		mode.IfType,
+		mode.MediaPresent,
 		dev->dev_addr[0],
 		dev->dev_addr[1],
 		dev->dev_addr[2],
@@ -454,8 +510,14 @@ int uefi_nic_exit(void)
 	for(int i = 0 ; i < uefi_nic_count ; i++)
 	{
 		uefi_nic_t * nic = uefi_nics[i];
+		unsigned long flags;
+
 		printk("uefi%d: shutdown nic\n", i);
-		nic->uefi_nic->Shutdown(nic->uefi_nic);
+		if (uefi_firmware_enter(&flags) < 0)
+			continue;
+
+		uefi_call("Shutdown", nic->uefi_nic->Shutdown, nic->uefi_nic);
+		uefi_firmware_exit(flags);
 	}
 
 	return 0;
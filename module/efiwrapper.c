@@ -3,109 +3,856 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/io.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/fadvise.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <linux/log2.h>
+#include <linux/seqlock.h>
+#include <linux/math64.h>
+#include <linux/timer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/wait.h>
+#include <linux/preempt.h>
+#include <asm/pgalloc.h>
+#include <asm/tlbflush.h>
+#include <asm/hardirq.h>
 #include "efiwrapper.h"
 
-static uint64_t uefi_pagetable_0;
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+static int watchdog_ms = 5000;
+module_param(watchdog_ms, int, 0644);
+MODULE_PARM_DESC(watchdog_ms, "Declare the firmware dead if a call takes longer than this, 0 to disable");
+
+static int watchdog_kbs = 1024;
+module_param(watchdog_kbs, int, 0644);
+MODULE_PARM_DESC(watchdog_kbs, "Slowest expected disk transfer speed in KiB/s, which adds to the watchdog timeout for large transfers");
+
 static efi_system_table_t * gST;
 efi_boot_services_t * gBS;
+static efi_boot_services_t uefi_boot_services;
 static EFI_HANDLE kernel_handle;
 
-int uefi_memory_map_add(void)
+// UEFI's memory is identity mapped in the bottom half of its page
+// table, where Linux keeps user space.  Rather than poking it into
+// whatever process happens to be current, the firmware gets an
+// address space of its own, like the kernel's efi_mm: the UEFI
+// lower half and a copy of the kernel's upper half, so that the
+// module and Linux buffers are still visible to it.  This is only
+// switched to while a firmware call is in progress.
+static pgd_t * uefi_pgd;
+static unsigned long uefi_linux_cr3;
+
+// With PCID the firmware gets one of its own, above the ones that
+// Linux hands out to processes, so that neither side's TLB entries
+// have to be thrown away when switching between them.  Linux never
+// changes the UEFI half of the page table and the kernel half is
+// global, so the firmware's entries stay good between calls on the
+// same CPU.  The firmware might have changed its own page table
+// while it ran on another one, so moving CPUs still flushes them.
+// With PTI the kernel half isn't global, so both sides are flushed.
+#define UEFI_PCID	(TLB_NR_DYN_ASIDS + 1)
+
+static bool uefi_pcid;
+static int uefi_pcid_cpu = -1;
+static unsigned int uefi_tlb_count;
+
+int uefi_memory_map_init(void)
 {
-	uint64_t cr3_phys;
-	volatile uint64_t * linux_pagetable;
-	uint64_t linux_pagetable_0;
+	const uint64_t * const uefi_context = phys_to_virt(0x100); // hack!
+	const uint64_t uefi_cr3 = uefi_context[0x40/8];
+	const pgd_t * uefi_pagetable;
+	const pgd_t * linux_pagetable;
+	unsigned long flags;
+
+	if (uefi_pgd)
+		return 0;
+
+	if (uefi_context[0xa0/8] != 0xdecafbad)
+	{
+		printk("uefi context bad magic %llx, things will probably break\n", uefi_context[0xa0/8]);
+		return -1;
+	}
+
+	kernel_handle = (void*) uefi_context[0x90/8]; // %rdi passed to the efi stub
+	gST = (void*) uefi_context[0x98/8]; // %rsi passed to the efi stub
+
+	// with PTI the PGD has a user half as well, so it is
+	// allocated the same way the kernel does.
+	uefi_pgd = (void*) __get_free_pages(GFP_KERNEL | __GFP_ZERO, PGD_ALLOCATION_ORDER);
+	if (!uefi_pgd)
+		return -1;
+
+	uefi_pagetable = ioremap(uefi_cr3 & PAGE_MASK, PAGE_SIZE);
+	if (!uefi_pagetable)
+		goto fail;
+
+	memcpy(uefi_pgd, uefi_pagetable, KERNEL_PGD_BOUNDARY * sizeof(*uefi_pgd));
+	iounmap((void*) uefi_pagetable);
 
-	if (uefi_pagetable_0 == 0)
+	// every process has the same kernel half.  vmalloc faults will
+	// fill in any entries that are added to it later.
+	linux_pagetable = __va(read_cr3_pa());
+	memcpy(uefi_pgd + KERNEL_PGD_BOUNDARY, linux_pagetable + KERNEL_PGD_BOUNDARY, KERNEL_PGD_PTRS * sizeof(*uefi_pgd));
+
+	printk("UEFI CR3=%016llx CR3[0]=%016lx gST=%016llx\n", uefi_cr3, pgd_val(uefi_pgd[0]), (uint64_t) gST);
+
+	uefi_pcid = boot_cpu_has(X86_FEATURE_PCID)
+		&&  (__read_cr4() & X86_CR4_PCIDE)
+		&& !boot_cpu_has(X86_FEATURE_PTI);
+	if (uefi_pcid)
+		printk("UEFI using PCID %d\n", UEFI_PCID);
+
+	// keep a copy of the boot services table so that the function
+	// pointers can be read outside of the UEFI address space
+	if (uefi_firmware_enter(&flags) < 0)
+		goto fail;
+	if (gST->boottime)
+		uefi_boot_services = *gST->boottime;
+	uefi_firmware_exit(flags);
+
+	if (uefi_boot_services.hdr.signature == 0)
 	{
-		const uint64_t * const uefi_context = phys_to_virt(0x100); // hack!
-		const uint64_t uefi_cr3 = uefi_context[0x40/8];
-		const uint64_t * uefi_pagetable;
+		printk("UH OH: boot services is a null pointer?\n");
+		goto fail;
+	}
+
+	gBS = &uefi_boot_services;
 
-		if (uefi_context[0xa0/8] != 0xdecafbad)
+	// success!
+	return 0;
+
+fail:
+	free_pages((unsigned long) uefi_pgd, PGD_ALLOCATION_ORDER);
+	uefi_pgd = NULL;
+	return -1;
+}
+
+// remote shootdowns are counted, and any that arrived while the
+// firmware had interrupts on only flushed the UEFI PCID.
+static unsigned int uefi_tlb_shootdowns(void)
+{
+#ifdef CONFIG_SMP
+	return this_cpu_read(irq_stat.irq_tlb_count);
+#else
+	return 0;
+#endif
+}
+
+static void uefi_memory_map_switch(void)
+{
+	unsigned long cr3 = __pa(uefi_pgd);
+
+	uefi_linux_cr3 = __read_cr3();
+
+	if (uefi_pcid)
+	{
+		cr3 |= UEFI_PCID;
+		if (uefi_pcid_cpu == smp_processor_id())
+			cr3 |= X86_CR3_PCID_NOFLUSH;
+		uefi_pcid_cpu = smp_processor_id();
+		uefi_tlb_count = uefi_tlb_shootdowns();
+	}
+
+	// without PCID this flushes everything that isn't global
+	write_cr3(cr3);
+}
+
+static void uefi_memory_map_restore(void)
+{
+	if (uefi_pcid && uefi_tlb_count == uefi_tlb_shootdowns())
+	{
+		write_cr3(uefi_linux_cr3 | X86_CR3_PCID_NOFLUSH);
+		return;
+	}
+
+	write_cr3(uefi_linux_cr3);
+}
+
+// The firmware is not reentrant, so every call into it from the
+// block devices, NICs and TPM goes through this one lock.  The
+// holder may make nested calls (the helpers below take it too),
+// but an interrupt that arrives while the firmware has turned them
+// back on must not call in again; it gets -EBUSY instead of
+// deadlocking against itself.  The UEFI address space is switched
+// in by the outermost call, so any context may call the firmware,
+// although only process context will sleep waiting for it.
+static DEFINE_SPINLOCK(uefi_firmware_lock);
+static int uefi_firmware_cpu = -1;
+static struct task_struct * uefi_firmware_owner;
+static unsigned long uefi_firmware_context;
+static unsigned uefi_firmware_depth;
+static DECLARE_WAIT_QUEUE_HEAD(uefi_firmware_wait);
+
+// The innermost call that is in the firmware right now.  There can
+// only be one, but the watchdog looks at it without the firmware
+// lock, so the sequence count tells it if it has a consistent copy.
+static struct {
+	seqcount_t seq;
+	uefi_call_frame_t frame;
+} uefi_call_current = {
+	.seq = SEQCNT_ZERO(uefi_call_current.seq),
+};
+
+// Once a call has overstayed its deadline the firmware lock might
+// never be released, so nothing else is allowed to try until that
+// call comes back, if it ever does.
+static atomic_t uefi_firmware_dead = ATOMIC_INIT(0);
+static struct timer_list uefi_watchdog_timer;
+
+bool uefi_firmware_is_dead(void)
+{
+	return atomic_read(&uefi_firmware_dead) != 0;
+}
+
+// Returns true if the firmware is dead, either from before or
+// because the current call has just missed its deadline.
+static bool uefi_watchdog_check(void)
+{
+	uefi_call_frame_t call;
+	char args[UEFI_CALL_ARGS * 20];
+	size_t len = 0;
+	unsigned seq;
+	u64 now;
+
+	if (uefi_firmware_is_dead())
+		return true;
+
+	args[0] = '\0';
+
+	do {
+		seq = read_seqcount_begin(&uefi_call_current.seq);
+		call = uefi_call_current.frame;
+	} while (read_seqcount_retry(&uefi_call_current.seq, seq));
+
+	now = ktime_get_ns();
+	if (!call.site || call.deadline_ns == 0 || now < call.deadline_ns)
+		return false;
+
+	// only the first one to notice reports it
+	if (atomic_xchg(&uefi_firmware_dead, 1) != 0)
+		return true;
+
+	for(unsigned i = 0 ; i < min_t(unsigned, call.nargs, UEFI_CALL_ARGS) ; i++)
+		len += scnprintf(args + len, sizeof(args) - len, "%s%lx", i ? ", " : "", call.args[i]);
+
+	printk(KERN_ERR "uefi watchdog: %s(%s%s) from %s (%pS) on cpu %d stuck for %llu ms, firmware is dead\n",
+		call.site->method,
+		args,
+		call.nargs > UEFI_CALL_ARGS ? ", ..." : "",
+		call.site->func,
+		call.caller,
+		call.cpu,
+		(now - call.start_ns) / NSEC_PER_MSEC
+	);
+
+	return true;
+}
+
+// The watchdog timer stays off the CPU that is in the firmware, in
+// case that one never comes back to take interrupts.  Callers that
+// are waiting for the firmware lock also check the deadline.  It
+// keeps running while the firmware is dead, since the stuck call
+// might come back and then get stuck again later.
+static void uefi_watchdog(struct timer_list * timer)
+{
+	const int firmware_cpu = READ_ONCE(uefi_firmware_cpu);
+	int cpu = smp_processor_id();
+
+	// nobody waiting for the lock is going to get it for now
+	if (uefi_watchdog_check())
+		wake_up_all(&uefi_firmware_wait);
+
+	if (firmware_cpu >= 0)
+		cpu = cpumask_any_but(cpu_online_mask, firmware_cpu);
+	if (cpu >= nr_cpu_ids)
+		cpu = smp_processor_id();
+
+	timer->expires = jiffies + HZ;
+	add_timer_on(timer, cpu);
+}
+
+int uefi_watchdog_init(void)
+{
+	timer_setup(&uefi_watchdog_timer, uefi_watchdog, TIMER_PINNED);
+	uefi_watchdog_timer.expires = jiffies + HZ;
+	add_timer(&uefi_watchdog_timer);
+	return 0;
+}
+
+void uefi_watchdog_exit(void)
+{
+	del_timer_sync(&uefi_watchdog_timer);
+}
+
+// One attempt at the firmware lock.  Returns -EAGAIN if another CPU
+// has it, with interrupts back the way they were.
+static int uefi_firmware_try(unsigned long * flags)
+{
+	const unsigned long context = irq_count();
+	int cpu;
+
+	if (!uefi_pgd)
+		return -ENODEV;
+	if (uefi_firmware_is_dead())
+		return -EIO;
+
+	local_irq_save(*flags);
+	cpu = smp_processor_id();
+
+	if (READ_ONCE(uefi_firmware_cpu) == cpu)
+	{
+		if (uefi_firmware_owner != current
+		||  uefi_firmware_context != context)
 		{
-			printk("uefi context bad magic %llx, things will probably break\n", uefi_context[0xa0/8]);
-			return -1;
+			local_irq_restore(*flags);
+			return -EBUSY;
+		}
+	} else {
+		if (!spin_trylock(&uefi_firmware_lock))
+		{
+			local_irq_restore(*flags);
+			return uefi_watchdog_check() ? -EIO : -EAGAIN;
 		}
 
-		uefi_pagetable = ioremap(uefi_cr3 & ~0xFFF, 0x1000);
-		uefi_pagetable_0 = uefi_pagetable[0];
-		kernel_handle = (void*) uefi_context[0x90/8]; // %rdi passed to the efi stub
-		gST = (void*) uefi_context[0x98/8]; // %rsi passed to the efi stub
+		WRITE_ONCE(uefi_firmware_cpu, cpu);
+		uefi_firmware_owner = current;
+		uefi_firmware_context = context;
+		uefi_memory_map_switch();
+	}
 
-		printk("UEFI CR3=%016llx CR3[0]=%016llx gST=%016llx\n", uefi_cr3, uefi_pagetable_0, (uint64_t) gST);
+	uefi_firmware_depth++;
 
-	}
+	return 0;
+}
 
-	// get our current CR3, masking out the ASID, to get the
-	// pointer to our page table
-	__asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3_phys));
+// For callers in atomic context that have something better to do
+// than wait, like the NIC transmit and receive paths.
+int uefi_firmware_try_enter(unsigned long * flags)
+{
+	return uefi_firmware_try(flags);
+}
 
-	linux_pagetable = phys_to_virt(cr3_phys & ~0xFFF);
-	linux_pagetable_0 = linux_pagetable[0];
+// Process context sleeps until the holder is done, since a disk
+// transfer can keep the firmware for a long time.  Anything that
+// can't sleep spins with interrupts on between the attempts.  The
+// watchdog wakes up the sleepers if the holder never comes back.
+int uefi_firmware_enter(unsigned long * flags)
+{
+	int rc;
 
+	if (in_atomic() || irqs_disabled())
+	{
+		while ((rc = uefi_firmware_try(flags)) == -EAGAIN)
+			cpu_relax();
+		return rc;
+	}
+
+	wait_event(uefi_firmware_wait, (rc = uefi_firmware_try(flags)) != -EAGAIN);
+	return rc;
+}
 
-	if (linux_pagetable_0 != 0
-	&&  linux_pagetable_0 != uefi_pagetable_0)
+void uefi_firmware_exit(unsigned long flags)
+{
+	if (--uefi_firmware_depth == 0)
 	{
-		printk("UH OH: linux has something mapped at 0x0: CR3=%016llx CR3[0]=%016llx\n", cr3_phys, linux_pagetable_0);
-		return -1;
+		uefi_memory_map_restore();
+		uefi_firmware_owner = NULL;
+		WRITE_ONCE(uefi_firmware_cpu, -1);
+		spin_unlock(&uefi_firmware_lock);
+
+		if (wq_has_sleeper(&uefi_firmware_wait))
+			wake_up(&uefi_firmware_wait);
 	}
 
-	// poke in the entry for the UEFI page table that we've stored
-	// reusing UEFI's linear map of low memory
-	linux_pagetable[0] = uefi_pagetable_0;
+	local_irq_restore(flags);
+}
 
-	// are we supposed to force a TLB flush or something?
-	__asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3_phys) : "memory");
+// Call sites are added to the list the first time that they are
+// used, under the firmware lock, and are never removed since they
+// are static in the module.
+static uefi_call_site_t * uefi_call_sites;
 
+// Block transfers get the watchdog_ms for the call itself plus
+// however long the data takes at the slowest expected disk speed,
+// or 0 if the watchdog is off.
+int uefi_watchdog_timeout(size_t bytes)
+{
+	const int timeout_ms = READ_ONCE(watchdog_ms);
+	const int kbs = READ_ONCE(watchdog_kbs);
 
-	// we can use the UEFI address space pointers now
-	gBS = gST->boottime;
+	if (timeout_ms <= 0)
+		return 0;
+	if (kbs <= 0)
+		return timeout_ms;
 
-	if (gBS == 0)
+	return min_t(u64, INT_MAX, timeout_ms + div_u64((u64) bytes * MSEC_PER_SEC, kbs * 1024ULL));
+}
+
+// The firmware can call back into Linux while a call is in progress,
+// and that can make calls of its own.  The outer call is saved on
+// the caller's stack and put back when the nested one is done.
+u64 uefi_call_start(const uefi_call_site_t * site, int timeout_ms, const unsigned long * args, unsigned nargs, const void * caller, uefi_call_frame_t * outer)
+{
+	const u64 now = ktime_get_ns();
+
+	if (timeout_ms == 0)
+		timeout_ms = READ_ONCE(watchdog_ms);
+
+	*outer = uefi_call_current.frame;
+
+	write_seqcount_begin(&uefi_call_current.seq);
+	uefi_call_current.frame.site = site;
+	memcpy(uefi_call_current.frame.args, args, sizeof(uefi_call_current.frame.args));
+	uefi_call_current.frame.nargs = nargs;
+	uefi_call_current.frame.caller = caller;
+	uefi_call_current.frame.start_ns = now;
+	uefi_call_current.frame.deadline_ns = timeout_ms > 0 ? now + timeout_ms * NSEC_PER_MSEC : 0;
+	uefi_call_current.frame.cpu = smp_processor_id();
+	write_seqcount_end(&uefi_call_current.seq);
+
+	return now;
+}
+
+void uefi_call_done(uefi_call_site_t * site, u64 start_ns, unsigned long status, const void * caller, const uefi_call_frame_t * outer)
+{
+	const u64 ns = ktime_get_ns() - start_ns;
+
+	write_seqcount_begin(&uefi_call_current.seq);
+	uefi_call_current.frame = *outer;
+	write_seqcount_end(&uefi_call_current.seq);
+
+	// the call that the watchdog gave up on has come back, so the
+	// firmware is usable again unless the outer call is overdue too.
+	// whoever had requests in flight while it was dead has already
+	// failed them.
+	if ((!outer->site || outer->deadline_ns == 0 || start_ns + ns < outer->deadline_ns)
+	&&  atomic_xchg(&uefi_firmware_dead, 0) != 0)
+		printk(KERN_ERR "uefi watchdog: %s from %s came back after %llu ms, firmware is alive\n",
+			site->method,
+			site->func,
+			ns / NSEC_PER_MSEC
+		);
+
+	if (site->count++ == 0)
 	{
-		printk("UH OH: boot services is a null pointer?\n");
-		return -1;
+		site->next = uefi_call_sites;
+		smp_store_release(&uefi_call_sites, site);
 	}
 
-#if 0 // debug on 5.15
-	printk("gST=%llx\n", (uint64_t) gST);
-	for(int i = 0 ; i < 64 ; i++)
-		printk("%08x", i[(uint32_t*)gST]);
-	printk("\n");
+	site->total_ns += ns;
+	if (ns > site->max_ns)
+		site->max_ns = ns;
+	site->caller = caller;
 
-	printk("gBS=%llx\n", (uint64_t) gBS);
-	for(int i = 0 ; i < 64 ; i++)
-		printk("%08x", i[(uint32_t*)gBS]);
-	printk("\n");
-#endif
+	trace_uefi_call(site->method, site->func, caller, ns, status);
+}
+
+// The drivers' tables and histograms go in debugfs under uefidev,
+// since they are not one value per file.
+struct dentry * uefi_debugfs;
+
+// one line per call site: method, calling function, count, total and
+// max microseconds in the firmware, and who called the function
+static int calls_show(struct seq_file * m, void * unused)
+{
+	for(const uefi_call_site_t * site = smp_load_acquire(&uefi_call_sites) ; site ; site = site->next)
+	{
+		seq_printf(m, "%s %s %lu %llu %llu %pS\n",
+			site->method,
+			site->func,
+			site->count,
+			site->total_ns / 1000,
+			site->max_ns / 1000,
+			site->caller
+		);
+	}
 
-	// success!
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(calls);
 
+int uefi_call_stats_init(void)
+{
+	// debugfs failures are not worth reporting
+	uefi_debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+	debugfs_create_file("calls", 0444, uefi_debugfs, NULL, &calls_fops);
 
-void * uefi_alloc(size_t len)
+	return 0;
+}
+
+// Copy from UEFI memory, which is only mapped during firmware calls,
+// to somewhere Linux can see it.
+int uefi_copy_from(void * dst, const void * uefi_src, size_t len)
 {
-	UINTN pages = (len + 4095) / 4096;
-	EFI_PHYSICAL_ADDRESS uefi_buffer;
+	unsigned long flags;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return -EBUSY;
+
+	memcpy(dst, uefi_src, len);
+	uefi_firmware_exit(flags);
+
+	return 0;
+}
+
+// Make a copy of a UEFI device path, including the end node, that
+// Linux can use outside of firmware calls.  Must be kfree()'ed.
+EFI_DEVICE_PATH_PROTOCOL * uefi_device_path_dup(const EFI_DEVICE_PATH_PROTOCOL * dp)
+{
+	const EFI_DEVICE_PATH_PROTOCOL * node = dp;
+	EFI_DEVICE_PATH_PROTOCOL * copy;
+	unsigned long flags;
+	size_t len = 0;
+
+	if (!dp)
+		return NULL;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return NULL;
+
+	while (1)
+	{
+		const unsigned node_len = node->Length[0] | node->Length[1] << 8;
+		if (node_len < sizeof(*node) || len + node_len > PAGE_SIZE)
+		{
+			len = 0;
+			break;
+		}
 
+		len += node_len;
+		if (node->Type == END_DEVICE_PATH_TYPE)
+			break;
+
+		node = (const void*) node + node_len;
+	}
+
+	uefi_firmware_exit(flags);
+
+	if (len == 0)
+		return NULL;
+
+	copy = kmalloc(len, GFP_KERNEL);
+	if (copy && uefi_copy_from(copy, dp, len) < 0)
+	{
+		kfree(copy);
+		copy = NULL;
+	}
+
+	return copy;
+}
+
+
+// UEFI memory that the module has allocated, so that it can be given
+// back with FreePages and accounted for in /sys/firmware/efi/memory.
+// Freed buffers of up to UEFI_POOL_CLASSES power of two page counts
+// are kept for reuse, up to pool_kb in total, so that rewriting the
+// loader or ramdisk doesn't keep fragmenting the firmware's memory.
+#define UEFI_POOL_CLASSES 10 // 4 KiB to 2 MiB
+
+static int pool_kb = 8192;
+module_param(pool_kb, int, 0644);
+MODULE_PARM_DESC(pool_kb, "Freed UEFI memory to keep for reuse in KiB");
+
+typedef struct {
+	struct list_head list;
+	EFI_PHYSICAL_ADDRESS addr;
+	UINTN pages;
+	int class; // -1 if not pooled
+} uefi_alloc_t;
+
+static LIST_HEAD(uefi_allocs);
+static struct list_head uefi_pool[UEFI_POOL_CLASSES];
+static DEFINE_MUTEX(uefi_alloc_mutex);
+
+static struct {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long reused;
+	unsigned long outstanding;
+	unsigned long outstanding_pages;
+	unsigned long peak_pages;
+	unsigned long pooled_pages;
+} uefi_alloc_stats;
+
+static int uefi_alloc_class(UINTN pages)
+{
+	const int class = order_base_2(pages);
+	return class < UEFI_POOL_CLASSES ? class : -1;
+}
+
+static EFI_PHYSICAL_ADDRESS uefi_allocate_pages(UINTN pages)
+{
 	efi_status_t EFIAPI (*allocate_pages)(int, int, unsigned long, efi_physical_addr_t *)
 		= (void*) gBS->allocate_pages;
+	EFI_PHYSICAL_ADDRESS uefi_buffer;
+	unsigned long flags;
+	int status;
 
+	if (uefi_firmware_enter(&flags) < 0)
+		return 0;
 
-	int status = allocate_pages(
+	status = uefi_call("AllocatePages", allocate_pages,
 		EFI_ALLOCATE_ANY_PAGES,
 		EFI_BOOT_SERVICES_DATA,
 		pages,
 		&uefi_buffer
 	);
 
+	uefi_firmware_exit(flags);
+
 	if (status != 0)
+		return 0;
+
+	return uefi_buffer;
+}
+
+static void uefi_free_pages(EFI_PHYSICAL_ADDRESS addr, UINTN pages)
+{
+	efi_status_t EFIAPI (*free_pages)(efi_physical_addr_t, unsigned long)
+		= (void*) gBS->free_pages;
+	unsigned long flags;
+	int status;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return;
+
+	status = uefi_call("FreePages", free_pages, addr, pages);
+	uefi_firmware_exit(flags);
+
+	if (status != 0)
+		printk("uefi_free: %016llx + %llx pages failed %d\n", addr, (uint64_t) pages, status);
+}
+
+// Add a newly allocated buffer to the list of outstanding ones
+static void * uefi_alloc_track(uefi_alloc_t * a)
+{
+	mutex_lock(&uefi_alloc_mutex);
+	list_add(&a->list, &uefi_allocs);
+	uefi_alloc_stats.allocs++;
+	uefi_alloc_stats.outstanding++;
+	uefi_alloc_stats.outstanding_pages += a->pages;
+	uefi_alloc_stats.peak_pages = max(uefi_alloc_stats.peak_pages, uefi_alloc_stats.outstanding_pages);
+	mutex_unlock(&uefi_alloc_mutex);
+
+	return (void*) a->addr;
+}
+
+// Allocate UEFI memory, which is identity mapped in the firmware's
+// address space and so can be passed to it directly.  The pointer
+// is its physical address; Linux must memremap() it to use it.
+// May sleep.
+void * uefi_alloc(size_t len)
+{
+	const UINTN pages = max_t(UINTN, (len + 4095) / 4096, 1);
+	const int class = uefi_alloc_class(pages);
+	uefi_alloc_t * a = NULL;
+
+	if (class >= 0)
+	{
+		mutex_lock(&uefi_alloc_mutex);
+		a = list_first_entry_or_null(&uefi_pool[class], uefi_alloc_t, list);
+		if (a)
+		{
+			list_del(&a->list);
+			uefi_alloc_stats.pooled_pages -= a->pages;
+			uefi_alloc_stats.reused++;
+		}
+		mutex_unlock(&uefi_alloc_mutex);
+	}
+
+	if (!a)
+	{
+		a = kzalloc(sizeof(*a), GFP_KERNEL);
+		if (!a)
+			return NULL;
+
+		a->class = class;
+		a->pages = class >= 0 ? 1 << class : pages;
+		a->addr = uefi_allocate_pages(a->pages);
+		if (!a->addr)
+		{
+			kfree(a);
+			return NULL;
+		}
+	}
+
+	return uefi_alloc_track(a);
+}
+
+// Allocate a buffer whose start and end are aligned, which the
+// firmware does not support directly, by allocating extra pages
+// and then giving back the ones on either side.  These are always
+// large, so they are not pooled.
+void * uefi_alloc_aligned(size_t len, size_t align)
+{
+	const UINTN align_pages = align / 4096;
+	UINTN pages;
+	UINTN head;
+	EFI_PHYSICAL_ADDRESS uefi_buffer;
+	EFI_PHYSICAL_ADDRESS aligned;
+	uefi_alloc_t * a;
+
+	if (align_pages <= 1)
+		return uefi_alloc(len);
+
+	pages = roundup((len + 4095) / 4096, align_pages);
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
 		return NULL;
 
-	return (void*) uefi_buffer;
+	uefi_buffer = uefi_allocate_pages(pages + align_pages - 1);
+	if (!uefi_buffer)
+	{
+		kfree(a);
+		return NULL;
+	}
+
+	aligned = roundup(uefi_buffer, align);
+	head = (aligned - uefi_buffer) / 4096;
+
+	if (head != 0)
+		uefi_free_pages(uefi_buffer, head);
+	if (head != align_pages - 1)
+		uefi_free_pages(aligned + pages * 4096, align_pages - 1 - head);
+
+	a->addr = aligned;
+	a->pages = pages;
+	a->class = -1;
+
+	return uefi_alloc_track(a);
+}
+
+// Give the pages after the first len bytes of a buffer back to the
+// firmware, for one that turned out to be larger than it needed.
+// What is left isn't a pool size any more, so it won't be pooled.
+// May sleep.
+void uefi_free_tail(void * ptr, size_t len)
+{
+	const EFI_PHYSICAL_ADDRESS addr = (EFI_PHYSICAL_ADDRESS) ptr;
+	const UINTN keep = max_t(UINTN, (len + 4095) / 4096, 1);
+	UINTN tail = 0;
+	uefi_alloc_t * a;
+
+	mutex_lock(&uefi_alloc_mutex);
+
+	list_for_each_entry(a, &uefi_allocs, list)
+	{
+		if (a->addr != addr)
+			continue;
+
+		if (a->pages > keep)
+		{
+			tail = a->pages - keep;
+			a->pages = keep;
+			a->class = -1;
+			uefi_alloc_stats.outstanding_pages -= tail;
+		}
+		break;
+	}
+
+	mutex_unlock(&uefi_alloc_mutex);
+
+	if (tail)
+		uefi_free_pages(addr + keep * 4096, tail);
+}
+
+// Give back memory from uefi_alloc() or uefi_alloc_aligned(), either
+// to the pool or to the firmware.  May sleep.
+void uefi_free(void * ptr)
+{
+	const EFI_PHYSICAL_ADDRESS addr = (EFI_PHYSICAL_ADDRESS) ptr;
+	const unsigned long pool_pages = max(pool_kb, 0) / 4;
+	uefi_alloc_t * a;
+
+	if (!ptr)
+		return;
+
+	mutex_lock(&uefi_alloc_mutex);
+
+	list_for_each_entry(a, &uefi_allocs, list)
+	{
+		if (a->addr == addr)
+			goto found;
+	}
+
+	mutex_unlock(&uefi_alloc_mutex);
+	printk("uefi_free: %016llx was not allocated\n", addr);
+	return;
+
+found:
+	list_del(&a->list);
+	uefi_alloc_stats.frees++;
+	uefi_alloc_stats.outstanding--;
+	uefi_alloc_stats.outstanding_pages -= a->pages;
+
+	if (a->class >= 0
+	&&  uefi_alloc_stats.pooled_pages + a->pages <= pool_pages)
+	{
+		list_add(&a->list, &uefi_pool[a->class]);
+		uefi_alloc_stats.pooled_pages += a->pages;
+		a = NULL;
+	}
+
+	mutex_unlock(&uefi_alloc_mutex);
+
+	if (!a)
+		return;
+
+	uefi_free_pages(a->addr, a->pages);
+	kfree(a);
+}
+
+static ssize_t uefi_memory_show(struct kobject * kobj, struct kobj_attribute * attr, char * buf)
+{
+	mutex_lock(&uefi_alloc_mutex);
+	sprintf(buf,
+		"allocs %lu\n"
+		"frees %lu\n"
+		"reused %lu\n"
+		"outstanding %lu\n"
+		"outstanding_bytes %lu\n"
+		"peak_bytes %lu\n"
+		"pooled_bytes %lu\n",
+		uefi_alloc_stats.allocs,
+		uefi_alloc_stats.frees,
+		uefi_alloc_stats.reused,
+		uefi_alloc_stats.outstanding,
+		uefi_alloc_stats.outstanding_pages * 4096,
+		uefi_alloc_stats.peak_pages * 4096,
+		uefi_alloc_stats.pooled_pages * 4096
+	);
+	mutex_unlock(&uefi_alloc_mutex);
+
+	return strlen(buf);
+}
+
+static struct kobj_attribute uefi_memory_attr
+	= __ATTR(memory, 0444, uefi_memory_show, NULL);
+
+int uefi_alloc_init(void)
+{
+	int status;
+
+	for(int i = 0 ; i < UEFI_POOL_CLASSES ; i++)
+		INIT_LIST_HEAD(&uefi_pool[i]);
+
+	status = sysfs_create_file(efi_kobj, &uefi_memory_attr.attr);
+	if (status < 0)
+	{
+		printk("uefidev: unable to create /sys/firmware/efi/memory: rc=%d\n", status);
+		return -1;
+	}
+
+	return 0;
 }
 
 #define EFI_DEVICE_PATH_TO_TEXT_PROTOCOL_GUID EFI_GUID(0x8b843e20, 0x8132, 0x4852,  0x90, 0xcc, 0x55, 0x1a, 0x4e, 0x4a, 0x7f, 0x1c)
@@ -128,16 +875,19 @@ char * uefi_device_path_to_name(EFI_HANDLE dev_handle)
 	EFI_DEVICE_PATH_PROTOCOL * dp = uefi_handle_protocol(&EFI_DEVICE_PATH_PROTOCOL_GUID, dev_handle);
 	char * dp2 = NULL; // wide-char return
 	static char buf[256];
+	unsigned long flags;
 
 	if (!dp2txt || !dp)
 		return "LocateHandle DevicePath failed";
 
-	dp2 = (char*) dp2txt->ConvertDevicePathToText(dp, 0, 0);
-	if (!dp2)
-		return "ConvertDevicePathToText failed";
+	if (uefi_firmware_enter(&flags) < 0)
+		return "Firmware busy";
+
+	dp2 = (char*) uefi_call("ConvertDevicePathToText", dp2txt->ConvertDevicePathToText, dp, 0, 0);
 
-	// convert it to a normal string, ensuring there is a nul terminator at the end
-	for(int i = 0 ; i < sizeof(buf)-1 ; i++)
+	// convert it to a normal string, ensuring there is a nul terminator
+	// at the end, while the string is still in our address space
+	for(int i = 0 ; dp2 && i < sizeof(buf)-1 ; i++)
 	{
 		uint16_t c = dp2[2*i];
 		buf[i] = c;
@@ -145,6 +895,11 @@ char * uefi_device_path_to_name(EFI_HANDLE dev_handle)
 			break;
 	}
 
+	uefi_firmware_exit(flags);
+
+	if (!dp2)
+		return "ConvertDevicePathToText failed";
+
 	return buf;
 }
 
@@ -159,7 +914,13 @@ int uefi_locate_handles(efi_guid_t * guid, EFI_HANDLE * handles, int max_handles
 //	if (locate_handle == 0)
 //		print_hex_dump_bytes("bootservices", KERN_ERR, gBS, 512);
 
-	int status = locate_handle(
+	unsigned long flags;
+	int status;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
+
+	status = uefi_call("LocateHandle", locate_handle,
 		EFI_LOCATE_BY_PROTOCOL,
 		guid,
 		NULL,
@@ -167,6 +928,8 @@ int uefi_locate_handles(efi_guid_t * guid, EFI_HANDLE * handles, int max_handles
 		handles
 	);
 
+	uefi_firmware_exit(flags);
+
 	if (status != 0)
 		return -1;
 
@@ -174,6 +937,86 @@ int uefi_locate_handles(efi_guid_t * guid, EFI_HANDLE * handles, int max_handles
 	return handlesize / sizeof(*handles);
 }
 
+// Find every handle that supports a protocol, however many there
+// are.  The array is allocated by Linux and must be kfree()'ed.
+EFI_HANDLE * uefi_locate_all_handles(efi_guid_t * guid, int * count_out)
+{
+	efi_status_t EFIAPI (*locate_handle)(int, efi_guid_t *, void *,
+                                      unsigned long *, efi_handle_t *) = (void*) gBS->locate_handle;
+	EFI_HANDLE * handles = NULL;
+	unsigned long handlesize = 0;
+	unsigned long flags;
+	int status;
+
+	while (1)
+	{
+		if (uefi_firmware_enter(&flags) < 0)
+			break;
+
+		status = uefi_call("LocateHandle", locate_handle,
+			EFI_LOCATE_BY_PROTOCOL,
+			guid,
+			NULL,
+			&handlesize,
+			handles
+		);
+
+		uefi_firmware_exit(flags);
+
+		if (status == 0)
+		{
+			*count_out = handlesize / sizeof(*handles);
+			return handles;
+		}
+
+		// the firmware has told us how much space it needs,
+		// which may have changed by the time we ask again
+		kfree(handles);
+		handles = NULL;
+
+		if (status != 5) // EFI_BUFFER_TOO_SMALL
+			break;
+
+		handles = kmalloc(handlesize, GFP_KERNEL);
+		if (!handles)
+			break;
+	}
+
+	*count_out = 0;
+	return NULL;
+}
+
+// Return the next handle that has had a protocol installed since the
+// last call for this protocol notify registration, or NULL if there
+// are no more.
+EFI_HANDLE uefi_locate_notify_handle(void * registration)
+{
+	efi_status_t EFIAPI (*locate_handle)(int, efi_guid_t *, void *,
+                                      unsigned long *, efi_handle_t *) = (void*) gBS->locate_handle;
+	EFI_HANDLE handle;
+	unsigned long handlesize = sizeof(handle);
+	unsigned long flags;
+	int status;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return NULL;
+
+	status = uefi_call("LocateHandle", locate_handle,
+		EFI_LOCATE_BY_REGISTER_NOTIFY,
+		NULL,
+		registration,
+		&handlesize,
+		&handle
+	);
+
+	uefi_firmware_exit(flags);
+
+	if (status != 0)
+		return NULL;
+
+	return handle;
+}
+
 void * uefi_locate_and_handle_protocol(efi_guid_t * guid)
 {
 	void * handles[1];
@@ -188,12 +1031,20 @@ void * uefi_handle_protocol(efi_guid_t * guid, EFI_HANDLE handle)
 	efi_status_t EFIAPI (*handle_protocol)(efi_handle_t, efi_guid_t *, void **) = (void*) gBS->handle_protocol;
 
 	void * proto = NULL;
-	int status = handle_protocol(
+	unsigned long flags;
+	int status;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return NULL;
+
+	status = uefi_call("HandleProtocol", handle_protocol,
 		handle,
 		guid,
 		&proto
 	);
 
+	uefi_firmware_exit(flags);
+
 	if (status != 0)
 		return NULL;
 
@@ -226,10 +1077,14 @@ EFI_HANDLE uefi_load_and_start_image(void * buf, size_t len, EFI_DEVICE_PATH * f
 	EFI_IMAGE_START start_image = (void*) gBS->start_image;
 	EFI_HANDLE image_handle;
 	CHAR16 * exit_data;
-	UINTN exit_data_size;
+	UINTN exit_data_size = 0;
+	unsigned long flags;
 	int status;
 
-	status = load_image(
+	if (uefi_firmware_enter(&flags) < 0)
+		return NULL;
+
+	status = uefi_call("LoadImage", load_image,
 		0,
 		kernel_handle,
 		filepath,
@@ -238,10 +1093,10 @@ EFI_HANDLE uefi_load_and_start_image(void * buf, size_t len, EFI_DEVICE_PATH * f
 		&image_handle
 	);
 
-	if (status != 0)
-		return NULL;
+	if (status == 0)
+		status = uefi_call_timeout("StartImage", UEFI_CALL_FOREVER, start_image, image_handle, &exit_data_size, &exit_data);
 
-	status = start_image(image_handle, &exit_data_size, &exit_data);
+	uefi_firmware_exit(flags);
 
 	printk("uefi_loader: status=%d exit_data=%lld\n", status, exit_data_size);
 	if (status != 0)
@@ -251,40 +1106,49 @@ EFI_HANDLE uefi_load_and_start_image(void * buf, size_t len, EFI_DEVICE_PATH * f
 }
 
 
-void * uefi_alloc_and_read_file(const char * filename_in, size_t * size_out)
+// Files are read straight into the UEFI memory a chunk at a time,
+// with readahead of the next chunk started before the current one is
+// copied, so that a multi-GB image keeps the disk busy, shows its
+// progress and can be interrupted.
+static int read_chunk_kb = 4096;
+module_param(read_chunk_kb, int, 0644);
+MODULE_PARM_DESC(read_chunk_kb, "Size of each read when loading files into UEFI memory in KiB");
+
+// Filenames come from sysfs writes, so copy them and trim the
+// whitespace from both ends (echo /bin/test.gpt > ramdisk)
+char * uefi_filename_trim(char * buf, size_t size, const char * filename)
+{
+	strlcpy(buf, filename, size);
+	return strim(buf);
+}
+
+ssize_t uefi_progress_show(const uefi_progress_t * progress, char * buf)
+{
+	if (progress->filename[0] == '\0')
+		return 0;
+
+	return scnprintf(buf, PAGE_SIZE, "%s %lld %lld\n",
+		progress->filename,
+		READ_ONCE(progress->done),
+		READ_ONCE(progress->size)
+	);
+}
+
+void * uefi_alloc_and_read_file(const char * filename_in, size_t * size_out, size_t align, uefi_progress_t * progress)
 {
+	const size_t chunk = max(read_chunk_kb, 4) * 1024UL;
 	loff_t file_size;
 	loff_t pos = 0;
 	void * image;
+	void * mapped;
  	struct file * file;
 	ssize_t rc;
 
-	char filename[256];
-	unsigned len = 0;
-
-	// echo /bin/test.gpt > /sys/firmware/efi/ramdisk
-	// trim trailing whitespace from the filename,
-	while(len < sizeof(filename))
-	{
-		char c = *filename_in++;
-		filename[len++] = c;
-		if (c == '\0')
-			break;
-	}
-
-	// len is at least 1 and points to the nul at the end
-	len--;
-
-	while(len > 1)
-	{
-		unsigned char c = filename[--len];
-		if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
-			break;
-		filename[len] = '\0';
-	}
+	char buf[256];
+	const char * filename = uefi_filename_trim(buf, sizeof(buf), filename_in);
 
 	file = filp_open(filename, O_RDONLY, 0);
-	if (file == NULL)
+	if (IS_ERR_OR_NULL(file))
 	{
 		printk("uefi_loader: unable to open '%s'\n", filename);
 		goto fail_open;
@@ -293,21 +1157,60 @@ void * uefi_alloc_and_read_file(const char * filename_in, size_t * size_out)
 	file_size = i_size_read(file_inode(file));
 	printk("uefi_read_file: %s => %lld\n", filename, file_size);
 
-	// use UEFI to allocate the memory, which is a bit bonkers
-	uefi_memory_map_add();
+	if (progress)
+	{
+		strlcpy(progress->filename, filename, sizeof(progress->filename));
+		WRITE_ONCE(progress->size, file_size);
+		WRITE_ONCE(progress->done, 0);
+	}
 
-	image = uefi_alloc(file_size);
+	// use UEFI to allocate the memory, which is a bit bonkers
+	image = uefi_alloc_aligned(file_size, align);
 	if (!image)
 	{
 		printk("uefi_loader: could not allocate %lld bytes", file_size);
 		goto fail_alloc;
 	}
 
-	rc = kernel_read(file, image, file_size, &pos);
-	if (rc != file_size)
+	// the file is read once, straight through
+	vfs_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while (pos < file_size)
 	{
-		printk("uefi_loader: did not read entire file: %zu\n", rc);
-		goto fail_read;
+		const size_t len = min_t(loff_t, chunk, file_size - pos);
+
+		if (fatal_signal_pending(current))
+		{
+			printk("uefi_loader: %s cancelled at %lld\n", filename, pos);
+			goto fail_read;
+		}
+
+		// get the disk started on the next chunk while this one
+		// is copied into the UEFI memory
+		if (pos + len < file_size)
+			vfs_fadvise(file, pos + len, chunk, POSIX_FADV_WILLNEED);
+
+		// the UEFI pointer is its physical address, which has to be
+		// mapped into the kernel's address space for Linux to write it
+		mapped = memremap((phys_addr_t) image + pos, len, MEMREMAP_WB);
+		if (!mapped)
+		{
+			printk("uefi_loader: could not map %zu bytes", len);
+			goto fail_read;
+		}
+
+		rc = kernel_read(file, mapped, len, &pos);
+		memunmap(mapped);
+		if (rc != len)
+		{
+			printk("uefi_loader: did not read entire file: %lld\n", pos);
+			goto fail_read;
+		}
+
+		if (progress)
+			WRITE_ONCE(progress->done, pos);
+
+		cond_resched();
 	}
 
 	filp_close(file, NULL);
@@ -317,9 +1220,185 @@ void * uefi_alloc_and_read_file(const char * filename_in, size_t * size_out)
 	return image;
 
 fail_read:
-	// todo? should free image
+	uefi_free(image);
 fail_alloc:
 	filp_close(file, NULL);
 fail_open:
 	return NULL;
 }
+
+// Images can also be written to /dev/uefi_loader or /dev/uefi_ramdisk
+// by a program that doesn't know the size ahead of time, so the UEFI
+// buffer is grown as needed.  It is kept mapped the whole time so
+// that each write() is a single copy into the UEFI memory.  Growing
+// needs the old and new buffers at once, so callers that have an idea
+// of the final size (like a gzip trailer) pass it as a hint, and any
+// unused tail is given back when the image is finished.
+static int stream_initial_kb = 16384;
+module_param(stream_initial_kb, int, 0644);
+MODULE_PARM_DESC(stream_initial_kb, "Initial buffer for images written to the uefi char devices in KiB");
+
+void uefi_stream_init(uefi_stream_t * stream, size_t align, size_t hint, uefi_progress_t * progress)
+{
+	memset(stream, 0, sizeof(*stream));
+	mutex_init(&stream->mutex);
+	stream->align = align;
+	stream->hint = hint;
+	stream->progress = progress;
+
+	if (progress)
+	{
+		strlcpy(progress->filename, "-", sizeof(progress->filename));
+		WRITE_ONCE(progress->size, 0);
+		WRITE_ONCE(progress->done, 0);
+	}
+}
+
+static int uefi_stream_grow(uefi_stream_t * stream, size_t needed)
+{
+	size_t capacity = max_t(size_t, stream->capacity, max(stream_initial_kb, 4) * 1024UL);
+	void * image = NULL;
+	void * mapped;
+
+	// the hint might be garbage, so if it can't be had this falls
+	// back to growing the usual way
+	if (stream->capacity == 0 && stream->hint >= needed)
+	{
+		capacity = stream->hint;
+		image = uefi_alloc_aligned(capacity, stream->align);
+		if (!image)
+			capacity = max(stream_initial_kb, 4) * 1024UL;
+	}
+
+	if (!image)
+	{
+		while (capacity < needed)
+			capacity *= 2;
+
+		image = uefi_alloc_aligned(capacity, stream->align);
+		if (!image)
+			return -ENOMEM;
+	}
+
+	mapped = memremap((phys_addr_t) image, capacity, MEMREMAP_WB);
+	if (!mapped)
+	{
+		uefi_free(image);
+		return -ENOMEM;
+	}
+
+	if (stream->image)
+	{
+		memcpy(mapped, stream->mapped, stream->size);
+		memunmap(stream->mapped);
+		uefi_free(stream->image);
+	}
+
+	stream->image = image;
+	stream->mapped = mapped;
+	stream->capacity = capacity;
+
+	return 0;
+}
+
+// make room for at least len more bytes, for callers that write into
+// stream->mapped themselves (like the decompressors) and then advance size
+int uefi_stream_reserve(uefi_stream_t * stream, size_t len)
+{
+	int rc = 0;
+
+	mutex_lock(&stream->mutex);
+	if (stream->size + len > stream->capacity)
+		rc = uefi_stream_grow(stream, stream->size + len);
+	mutex_unlock(&stream->mutex);
+
+	return rc;
+}
+
+ssize_t uefi_stream_write(uefi_stream_t * stream, const char __user * buf, size_t len)
+{
+	ssize_t rc = len;
+
+	mutex_lock(&stream->mutex);
+
+	if (stream->size + len > stream->capacity)
+		rc = uefi_stream_grow(stream, stream->size + len);
+
+	if (rc >= 0 && copy_from_user(stream->mapped + stream->size, buf, len) != 0)
+		rc = -EFAULT;
+
+	if (rc >= 0)
+	{
+		stream->size += len;
+		if (stream->progress)
+			WRITE_ONCE(stream->progress->done, stream->size);
+	} else
+	if (!stream->error)
+	{
+		// the image has a hole in it, so it can't be used
+		stream->error = rc;
+	}
+
+	mutex_unlock(&stream->mutex);
+	return rc;
+}
+
+// Unmap the image and empty the stream, returning the image
+static void * uefi_stream_take(uefi_stream_t * stream)
+{
+	void * image = stream->image;
+
+	if (stream->mapped)
+		memunmap(stream->mapped);
+
+	stream->image = stream->mapped = NULL;
+	stream->size = stream->capacity = 0;
+	stream->error = 0;
+
+	return image;
+}
+
+// Hand the image over to the caller, who will pass it to the firmware
+// and then uefi_free() it when it is done.  The stream is empty again.
+// The image keeps its alignment at the end as well as the start.
+void * uefi_stream_finish(uefi_stream_t * stream, size_t * size_out)
+{
+	void * image;
+
+	mutex_lock(&stream->mutex);
+
+	*size_out = stream->size;
+	image = uefi_stream_take(stream);
+	if (image)
+		uefi_free_tail(image, roundup(*size_out, max_t(size_t, stream->align, PAGE_SIZE)));
+
+	if (stream->progress)
+		WRITE_ONCE(stream->progress->size, *size_out);
+
+	mutex_unlock(&stream->mutex);
+
+	return image;
+}
+
+// The char devices are flushed as the writer exits, by which time
+// the fatal signal that killed it has been taken off the pending
+// list, so the exit code says whether it finished on its own.
+bool uefi_stream_killed(void)
+{
+	const struct signal_struct * sig = current->signal;
+
+	if (fatal_signal_pending(current))
+		return true;
+
+	return (READ_ONCE(sig->flags) & SIGNAL_GROUP_EXIT)
+		&& (READ_ONCE(sig->group_exit_code) & 0x7f) != 0;
+}
+
+// Throw away whatever has been written, because it failed or because
+// the writer was killed part way through.
+void uefi_stream_free(uefi_stream_t * stream)
+{
+	mutex_lock(&stream->mutex);
+	uefi_free(uefi_stream_take(stream));
+	mutex_unlock(&stream->mutex);
+}
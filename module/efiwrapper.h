@@ -7,6 +7,8 @@
 #define _uefiblockdev_efi_wrapper_h_
 
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
 #include <linux/efi.h>
 #include <asm/io.h>
 #include <asm/efi.h>
@@ -78,7 +80,37 @@ typedef union {
 } EFI_IP_ADDRESS;
 
 #define EFI_DEVICE_PATH_PROTOCOL_GUID EFI_GUID(0x9576e91, 0x6d3f, 0x11d2, 0x8e, 0x39, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b)
-typedef void * EFI_DEVICE_PATH_PROTOCOL;
+
+// every device path node starts with this header
+typedef struct {
+    UINT8       Type;
+    UINT8       SubType;
+    UINT8       Length[2];
+} EFI_DEVICE_PATH_PROTOCOL;
+
+#define HARDWARE_DEVICE_PATH        0x01
+#define HW_MEMMAP_DP                0x03
+#define MEDIA_DEVICE_PATH           0x04
+#define END_DEVICE_PATH_TYPE        0x7f
+
+#define MEDIA_HARDDRIVE_DP          0x01
+
+typedef struct __attribute__((__packed__)) {
+    EFI_DEVICE_PATH_PROTOCOL    Header;
+    UINT32                      PartitionNumber;
+    UINT64                      PartitionStart;
+    UINT64                      PartitionSize;
+    UINT8                       Signature[16];
+    UINT8                       MBRType;
+    UINT8                       SignatureType;
+} HARDDRIVE_DEVICE_PATH;
+
+typedef struct __attribute__((__packed__)) {
+    EFI_DEVICE_PATH_PROTOCOL    Header;
+    UINT32                      MemoryType;
+    EFI_PHYSICAL_ADDRESS        StartingAddress;
+    EFI_PHYSICAL_ADDRESS        EndingAddress;
+} MEMMAP_DEVICE_PATH;
 
 #define EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID EFI_GUID( 0x964e5b22, 0x6459, 0x11d2, 0x8e, 0x39, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b)
 
@@ -90,6 +122,10 @@ typedef void * EFI_EVENT;
 
 #define INTERFACE_DECL(x) struct x
 
+#ifndef EFI_LOCATE_BY_REGISTER_NOTIFY
+#define EFI_LOCATE_BY_REGISTER_NOTIFY		1
+#endif
+
 #ifndef EFI_LOCATE_BY_PROTOCOL
 #define EFI_LOCATE_BY_PROTOCOL			2
 #endif
@@ -97,25 +133,144 @@ typedef void * EFI_EVENT;
 /* Helper functions to make it bearable to call EFI functions */
 extern efi_boot_services_t * gBS;
 
-extern int uefi_memory_map_add(void);
+// Every firmware call site keeps track of how often the method is
+// called and how long the firmware takes, which is shown in
+// debugfs uefidev/calls and sent to the uefidev:uefi_call tracepoint.
+typedef struct uefi_call_site {
+	const char * method;
+	const char * func;
+	const void * caller;
+	unsigned long count;
+	u64 total_ns;
+	u64 max_ns;
+	struct uefi_call_site * next;
+} uefi_call_site_t;
+
+// The call that is in the firmware, for the watchdog.  The firmware
+// can call back into Linux, so the outer one is kept on the stack
+// while a nested call is running.  The first few arguments are kept
+// so that a stuck call can be reported with them.
+#define UEFI_CALL_ARGS	6
+
+typedef struct {
+	const uefi_call_site_t * site;
+	unsigned long args[UEFI_CALL_ARGS];
+	unsigned nargs;
+	const void * caller;
+	u64 start_ns;
+	u64 deadline_ns;
+	int cpu;
+} uefi_call_frame_t;
+
+extern u64 uefi_call_start(const uefi_call_site_t * site, int timeout_ms, const unsigned long * args, unsigned nargs, const void * caller, uefi_call_frame_t * outer);
+extern void uefi_call_done(uefi_call_site_t * site, u64 start_ns, unsigned long status, const void * caller, const uefi_call_frame_t * outer);
+extern bool uefi_firmware_is_dead(void);
+extern int uefi_watchdog_timeout(size_t bytes);
+
+// for calls that are not expected to come back, like StartImage
+#define UEFI_CALL_FOREVER	-1
+
+// the arguments are evaluated again for these, so they must not
+// have side effects
+#define uefi_call_nargs(...) uefi_call_nargs_(__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define uefi_call_nargs_(a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, n, ...) (n)
+#define uefi_call_argv(...) uefi_call_argv_(__VA_ARGS__, 0, 0, 0, 0, 0, 0)
+#define uefi_call_argv_(a1, a2, a3, a4, a5, a6, ...) { \
+	(unsigned long) (a1), (unsigned long) (a2), (unsigned long) (a3), \
+	(unsigned long) (a4), (unsigned long) (a5), (unsigned long) (a6), \
+}
+
+// Call a firmware method and account for it.  This must be done
+// inside uefi_firmware_enter(), which serializes the counters.  If
+// the call takes longer than the timeout in ms (0 for the watchdog_ms
+// default, or uefi_watchdog_timeout() for transfers that scale with
+// their size) the watchdog declares the firmware dead.
+#define uefi_call_timeout(name, timeout, fn, ...) ({ \
+	static uefi_call_site_t __site = { .method = name, .func = __func__ }; \
+	const unsigned long __args[UEFI_CALL_ARGS] = uefi_call_argv(__VA_ARGS__); \
+	uefi_call_frame_t __outer; \
+	const u64 __start = uefi_call_start(&__site, (timeout), __args, uefi_call_nargs(__VA_ARGS__), __builtin_return_address(0), &__outer); \
+	const typeof((fn)(__VA_ARGS__)) __ret = (fn)(__VA_ARGS__); \
+	uefi_call_done(&__site, __start, (unsigned long) __ret, __builtin_return_address(0), &__outer); \
+	__ret; \
+})
+
+#define uefi_call(name, fn, ...) uefi_call_timeout(name, 0, fn, __VA_ARGS__)
+
+extern int uefi_memory_map_init(void);
+extern int uefi_firmware_enter(unsigned long * flags);
+extern int uefi_firmware_try_enter(unsigned long * flags);
+extern void uefi_firmware_exit(unsigned long flags);
+extern int uefi_copy_from(void * dst, const void * uefi_src, size_t len);
+extern EFI_DEVICE_PATH_PROTOCOL * uefi_device_path_dup(const EFI_DEVICE_PATH_PROTOCOL * dp);
 extern void * uefi_alloc(size_t len);
+extern void * uefi_alloc_aligned(size_t len, size_t align);
+extern void uefi_free(void * ptr);
+extern void uefi_free_tail(void * ptr, size_t len);
 extern char * uefi_device_path_to_name(EFI_HANDLE dev_handle);
 extern int uefi_locate_handles(efi_guid_t * guid, EFI_HANDLE * handles, int max_handles);
+extern EFI_HANDLE * uefi_locate_all_handles(efi_guid_t * guid, int * count_out);
+extern EFI_HANDLE uefi_locate_notify_handle(void * registration);
 extern EFI_HANDLE uefi_locate_handle(efi_guid_t * guid);
 extern void * uefi_handle_protocol(efi_guid_t * guid, EFI_HANDLE handle);
 extern void * uefi_locate_and_handle_protocol(efi_guid_t * guid);
 extern EFI_HANDLE uefi_load_and_start_image(void * buf, size_t len, EFI_DEVICE_PATH * filepath);
-extern void * uefi_alloc_and_read_file(const char * filename, size_t * size_out);
+// how far uefi_alloc_and_read_file() has got, for the sysfs show()
+typedef struct {
+	char filename[256];
+	loff_t size;
+	loff_t done;
+} uefi_progress_t;
+
+extern char * uefi_filename_trim(char * buf, size_t size, const char * filename);
+extern void * uefi_alloc_and_read_file(const char * filename, size_t * size_out, size_t align, uefi_progress_t * progress);
+extern ssize_t uefi_progress_show(const uefi_progress_t * progress, char * buf);
+
+// an image that is being written to one of the char devices
+typedef struct {
+	struct mutex mutex;
+	void * image;
+	void * mapped;
+	size_t size;
+	size_t capacity;
+	size_t align;
+	size_t hint; // expected final size, or 0 if unknown
+	int error; // the first write that failed
+	uefi_progress_t * progress;
+} uefi_stream_t;
+
+extern void uefi_stream_init(uefi_stream_t * stream, size_t align, size_t hint, uefi_progress_t * progress);
+extern int uefi_stream_reserve(uefi_stream_t * stream, size_t len);
+extern ssize_t uefi_stream_write(uefi_stream_t * stream, const char __user * buf, size_t len);
+extern void * uefi_stream_finish(uefi_stream_t * stream, size_t * size_out);
+extern void uefi_stream_free(uefi_stream_t * stream);
+extern bool uefi_stream_killed(void);
+
+// reads gzip, xz or zstd compressed files (if configured) into
+// UEFI memory, or uncompressed ones like uefi_alloc_and_read_file()
+extern void * uefi_alloc_and_decompress_file(const char * filename, size_t * size_out, size_t align, uefi_progress_t * progress);
 
 extern int uefi_register_protocol_callback(
 	EFI_GUID * guid,
 	void (*handler)(void*),
-	void * context
+	void * context,
+	void ** registration_out
 );
+extern EFI_EVENT uefi_create_event(void);
+extern int uefi_check_event(EFI_EVENT event);
+extern void uefi_close_event(EFI_EVENT event);
+extern int uefi_timer_tick(void);
 
 /* Device driver init functions go here */
+extern int uefi_call_stats_init(void);
+extern struct dentry * uefi_debugfs;
+extern int uefi_alloc_init(void);
+extern int uefi_watchdog_init(void);
+extern void uefi_watchdog_exit(void);
 extern int uefi_loader_init(void);
+extern void uefi_loader_exit(void);
 extern int uefi_ramdisk_init(void);
+extern void uefi_ramdisk_exit(void);
 extern int uefi_blockdev_init(void);
 extern int uefi_nic_init(void);
 extern int uefi_nic_exit(void);
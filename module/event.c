@@ -1,6 +1,8 @@
 /* UEFI event and callback wrapper
  */
 #include <linux/kernel.h>
+#include <linux/workqueue.h>
+#include <linux/timekeeping.h>
 #include "efiwrapper.h"
 
 typedef
@@ -68,37 +70,79 @@ EFI_STATUS
     IN EFI_EVENT                Event
     );
 
+typedef
+EFI_STATUS
+(EFIAPI *EFI_CHECK_EVENT) (
+    IN EFI_EVENT                Event
+    );
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_CLOSE_EVENT) (
+    IN EFI_EVENT                Event
+    );
+
+#define EFI_TIMER_ARCH_PROTOCOL_GUID EFI_GUID(0x26baccb3, 0x6f42, 0x11d4,  0xbc, 0xe7, 0x0, 0x80, 0xc7, 0x3c, 0x88, 0x81)
+
+typedef struct _EFI_TIMER_ARCH_PROTOCOL {
+    void *                      RegisterHandler;
+    void *                      SetTimerPeriod;
+    EFI_STATUS (EFIAPI *GetTimerPeriod)(
+        IN struct _EFI_TIMER_ARCH_PROTOCOL * This,
+        OUT UINT64 * TimerPeriod
+    );
+    EFI_STATUS (EFIAPI *GenerateSoftInterrupt)(
+        IN struct _EFI_TIMER_ARCH_PROTOCOL * This
+    );
+} EFI_TIMER_ARCH_PROTOCOL;
+
 typedef struct {
 	EFI_EVENT event;
 	void * registration;
 	void * context;
 	void (*handler)(void *);
+	struct work_struct work;
 } uefi_event_t;
 
 
-// UEFI calls back with MS ABI, so this must translate to Linux ABI
+static void uefi_event_work(struct work_struct * work)
+{
+	uefi_event_t * ev = container_of(work, uefi_event_t, work);
+	ev->handler(ev->context);
+}
+
+// UEFI calls back with MS ABI, so this must translate to Linux ABI.
+// The callback happens inside of a firmware call, with interrupts
+// off and the firmware lock held, so the handler is run later from
+// a workqueue where it can sleep and make firmware calls of its own.
 static void EFIAPI uefi_event_callback(EFI_EVENT Event, VOID * context)
 {
 	uefi_event_t * ev = context;
-	ev->handler(ev->context);
+	schedule_work(&ev->work);
 }
 
 int uefi_register_protocol_callback(
 	EFI_GUID * guid,
 	void (*handler)(void*),
-	void * context
+	void * context,
+	void ** registration_out
 )
 {
 	EFI_CREATE_EVENT create_event = (void*) gBS->create_event;
 	EFI_REGISTER_PROTOCOL_NOTIFY register_protocol_notify = (void*) gBS->register_protocol_notify;
 	EFI_SIGNAL_EVENT signal_event = (void*) gBS->signal_event;
 	uefi_event_t * ev = kzalloc(sizeof(*ev), GFP_KERNEL);
+	unsigned long flags;
 	int status;
 
 	ev->handler = handler;
 	ev->context = context;
+	INIT_WORK(&ev->work, uefi_event_work);
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
 
-	status = create_event(
+	status = uefi_call("CreateEvent", create_event,
 		EVT_NOTIFY_SIGNAL,
 		TPL_CALLBACK,
 		uefi_event_callback,
@@ -107,16 +151,117 @@ int uefi_register_protocol_callback(
 	);
 	printk("create event %d\n", status);
 
-	status = register_protocol_notify(
+	status = uefi_call("RegisterProtocolNotify", register_protocol_notify,
 		guid,
 		ev->event,
 		&ev->registration
 	);
 	printk("register protocol %d\n", status);
 
-	status = signal_event(ev->event);
+	// the handler can use this to find only the new handles
+	if (registration_out)
+		*registration_out = ev->registration;
+
+	status = uefi_call("SignalEvent", signal_event, ev->event);
+	uefi_firmware_exit(flags);
 	printk("signal event %d\n", status);
 
 	return 0;
 }
 
+
+
+// Create an event with no notification function, which can only
+// be polled with uefi_check_event().
+EFI_EVENT uefi_create_event(void)
+{
+	EFI_CREATE_EVENT create_event = (void*) gBS->create_event;
+	EFI_EVENT event;
+	unsigned long flags;
+	int status;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return NULL;
+
+	status = uefi_call("CreateEvent", create_event, 0, TPL_CALLBACK, NULL, NULL, &event);
+	uefi_firmware_exit(flags);
+
+	if (status != 0)
+		return NULL;
+
+	return event;
+}
+
+// returns 0 if the event has been signaled, 6 (EFI_NOT_READY) if not
+int uefi_check_event(EFI_EVENT event)
+{
+	EFI_CHECK_EVENT check_event = (void*) gBS->check_event;
+	unsigned long flags;
+	int status;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return 6; // EFI_NOT_READY
+
+	status = uefi_call("CheckEvent", check_event, event);
+	uefi_firmware_exit(flags);
+
+	return status;
+}
+
+void uefi_close_event(EFI_EVENT event)
+{
+	EFI_CLOSE_EVENT close_event = (void*) gBS->close_event;
+	unsigned long flags;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return;
+
+	uefi_call("CloseEvent", close_event, event);
+	uefi_firmware_exit(flags);
+}
+
+// Linux owns the interrupts, so the firmware timer never ticks
+// and anything that UEFI drivers do from timer events (such as
+// completing asynchronous requests) never happens. The timer
+// architectural protocol can fake a tick for us.
+//
+// Each tick advances the firmware's clock by a whole timer period
+// (10 ms on OVMF), so ticking any faster than that would make the
+// drivers' timeouts expire early.  Calls in between are ignored and
+// return 0.  Only the block worker ticks after the first call, so
+// the timestamps are not locked.
+int uefi_timer_tick(void)
+{
+	static EFI_TIMER_ARCH_PROTOCOL * timer;
+	static u64 period_ns;
+	static u64 last_ns;
+	const u64 now = ktime_get_ns();
+	unsigned long flags;
+	int status;
+
+	if (!timer)
+		timer = uefi_locate_and_handle_protocol(&EFI_TIMER_ARCH_PROTOCOL_GUID);
+	if (!timer)
+		return -1;
+
+	if (period_ns && now - last_ns < period_ns)
+		return 0;
+
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
+
+	if (!period_ns)
+	{
+		// in 100 ns units, 0 if the timer is off
+		UINT64 period = 0;
+		uefi_call("GetTimerPeriod", timer->GetTimerPeriod, timer, &period);
+		period_ns = period ? period * 100 : 10 * NSEC_PER_MSEC;
+		printk("uefi_timer: period %llu us\n", period_ns / NSEC_PER_USEC);
+	}
+
+	status = uefi_call("GenerateSoftInterrupt", timer->GenerateSoftInterrupt, timer);
+	uefi_firmware_exit(flags);
+
+	last_ns = now;
+	return status;
+}
@@ -2,38 +2,133 @@
  *
  * Allow new EFI modules to be loaded with the Boot Services
  * loaded image protocol by catting the EFI image into
- * /sys/firmware/efi/loader
+ * /sys/firmware/efi/loader, or by writing the image itself
+ * to /dev/uefi_loader.
  */
 #include <linux/kernel.h>
+#include <linux/sched/signal.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
 #include "efiwrapper.h"
 
+static uefi_progress_t uefi_loader_progress;
 
 static ssize_t store(struct kobject * kobj, struct kobj_attribute *attr, const char * buf, size_t count)
 {
 	// open that file and attempt to read it
 	size_t file_size;
-	void * image = uefi_alloc_and_read_file(buf, &file_size);
+	EFI_HANDLE handle;
+	void * image = uefi_alloc_and_read_file(buf, &file_size, 0, &uefi_loader_progress);
 
 	if (!image)
-		return -1;
+		return fatal_signal_pending(current) ? -EINTR : -1;
 
 	printk("uefi_loader: starting %s (%zu bytes)\n", buf, file_size);
-	if (!uefi_load_and_start_image(image, file_size, NULL))
+	handle = uefi_load_and_start_image(image, file_size, NULL);
+
+	// LoadImage has made its own copy of the image
+	uefi_free(image);
+
+	if (!handle)
 		return -1;
 
 	return count;
 }
 
 
+// the file being loaded, how many bytes have been read and its size
 static ssize_t show(struct kobject * kobj, struct kobj_attribute * attr, char * buf)
 {
-	printk("uefi_loader: show %llx\n", (uint64_t) buf);
-	return -1;
+	return uefi_progress_show(&uefi_loader_progress, buf);
 }
 
 static struct kobj_attribute uefi_loader_attr
 	= __ATTR(loader, 0600, show, store);
 
+
+// /dev/uefi_loader takes the EFI image itself and starts it when
+// the last writer closes the device.
+static int uefi_loader_open(struct inode * inode, struct file * file)
+{
+	uefi_stream_t * stream;
+
+	if ((file->f_flags & O_ACCMODE) != O_WRONLY)
+		return -EINVAL;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return -ENOMEM;
+
+	uefi_stream_init(stream, 0, 0, &uefi_loader_progress);
+	file->private_data = stream;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t uefi_loader_write(struct file * file, const char __user * buf, size_t len, loff_t * off)
+{
+	return uefi_stream_write(file->private_data, buf, len);
+}
+
+// flush is the only place that close() can report an error
+static int uefi_loader_flush(struct file * file, fl_owner_t id)
+{
+	uefi_stream_t * stream = file->private_data;
+	EFI_HANDLE handle;
+	size_t size;
+	void * image;
+
+	if (file_count(file) != 1)
+		return 0;
+
+	// a write that failed left a hole, and a killed writer might
+	// not have finished, so neither image can be trusted
+	if (stream->error || uefi_stream_killed())
+	{
+		const int rc = stream->error ? stream->error : -EINTR;
+		printk("uefi_loader: discarding /dev/uefi_loader after %zu bytes\n", stream->size);
+		uefi_stream_free(stream);
+		return rc;
+	}
+
+	image = uefi_stream_finish(stream, &size);
+	if (!image)
+		return 0;
+
+	printk("uefi_loader: starting /dev/uefi_loader (%zu bytes)\n", size);
+	handle = uefi_load_and_start_image(image, size, NULL);
+	uefi_free(image);
+
+	return handle ? 0 : -EIO;
+}
+
+static int uefi_loader_release(struct inode * inode, struct file * file)
+{
+	uefi_stream_t * stream = file->private_data;
+
+	uefi_stream_free(stream);
+	kfree(stream);
+
+	return 0;
+}
+
+static const struct file_operations uefi_loader_fops = {
+	.owner		= THIS_MODULE,
+	.open		= uefi_loader_open,
+	.write		= uefi_loader_write,
+	.flush		= uefi_loader_flush,
+	.release	= uefi_loader_release,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice uefi_loader_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "uefi_loader",
+	.fops		= &uefi_loader_fops,
+	.mode		= 0600,
+};
+
 int uefi_loader_init(void)
 {
 	// efi_kobj is the global for /sys/firmware/efi
@@ -47,5 +142,15 @@ int uefi_loader_init(void)
 	}
 
 	printk("uefi_loader: created /sys/firmware/efi/loader\n");
+
+	status = misc_register(&uefi_loader_dev);
+	if (status < 0)
+		printk("uefi_loader: unable to create /dev/uefi_loader: rc=%d\n", status);
+
 	return 0;
 }
+
+void uefi_loader_exit(void)
+{
+	misc_deregister(&uefi_loader_dev);
+}
@@ -13,9 +13,13 @@
 
 static int uefi_dev_init(void)
 {
-	if (uefi_memory_map_add() < 0)
+	if (uefi_memory_map_init() < 0)
 		return -1;
 
+	uefi_call_stats_init();
+	uefi_alloc_init();
+	uefi_watchdog_init();
+
 	if (uefi_loader_init() < 0)
 		return -1;
 
@@ -48,11 +52,16 @@ static void uefi_dev_exit(void)
 {
 	// block does not need any shutdown
 	// tpm does not require any shutdown
-	// ramdisk explicitly does not want to shutdown
+	// ramdisk explicitly does not want to shutdown, other than its /dev entry
 
 #ifdef CONFIG_UEFINET
 	uefi_nic_exit();
 #endif
+
+	uefi_ramdisk_exit();
+	uefi_loader_exit();
+
+	uefi_watchdog_exit();
 }
 
 module_exit(uefi_dev_exit);
@@ -1,59 +1,291 @@
 /* UEFI ramdisk interface
  *
- * Create a ram disk given a disk image by catting into
- * /sys/firmware/efi/ramdisk
+ * Create a ram disk given a disk image (which may be compressed)
+ * by catting into /sys/firmware/efi/ramdisk, or by writing the image itself
+ * to /dev/uefi_ramdisk.  Blank disks can be created by writing
+ * their size to /sys/firmware/efi/ramdisk_create.
  */
 #include <linux/kernel.h>
+#include <linux/sched/signal.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/io.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
 #include "efiwrapper.h"
 #include "ramdisk.h"
 
+static uefi_progress_t uefi_ramdisk_progress;
 
-static ssize_t store(struct kobject * kobj, struct kobj_attribute *attr, const char * buf, size_t count)
+// hand an image in UEFI memory to the RamDisk driver; it is owned
+// by the ramdisk if this succeeds and freed if it doesn't.
+static int uefi_ramdisk_register(void * image, size_t file_size)
 {
-	// open that file and attempt to read it
-	size_t file_size;
-	void * image;
 	EFI_DEVICE_PATH * devicepath;
 	EFI_RAM_DISK_PROTOCOL * ramdisk;
-
-	uefi_memory_map_add();
+	unsigned long flags;
+	int status;
 
 	ramdisk = uefi_locate_and_handle_protocol(&EFI_RAMDISK_PROTOCOL_GUID);
 	if (!ramdisk)
 	{
 		printk("uefi_ramdisk: vendor firmware has no RamDisk driver\n");
-		return -1;
+		uefi_free(image);
+		return -ENODEV;
 	}
 
-	image = uefi_alloc_and_read_file(buf, &file_size);
-	if (!image)
+	if (uefi_firmware_enter(&flags) < 0)
 	{
-		printk("uefi_ramdisk: alloc and read failed\n");
-		return -1;
+		uefi_free(image);
+		return -EBUSY;
 	}
 
-	printk("uefi_ramdisk: %s %zu bytes", buf, file_size);
-	ramdisk->Register(
+	// this will install a new BlockIo handle, and the block
+	// device scan will be run once the firmware call is done
+	status = uefi_call("RamDiskRegister", ramdisk->Register,
 		(UINT64) image, // physical address, since UEFI allocated it
 		file_size,
 		&EFI_RAMDISK_PROTOCOL_GUID,
 		NULL,
 		&devicepath
 	);
+	uefi_firmware_exit(flags);
+
+	// the image is the ramdisk's memory from now on, so it is
+	// only given back if the firmware didn't want it
+	if (status != 0)
+	{
+		printk("uefi_ramdisk: register failed %d\n", status);
+		uefi_free(image);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static ssize_t store(struct kobject * kobj, struct kobj_attribute *attr, const char * buf, size_t count)
+{
+	// open that file and attempt to read it
+	size_t file_size;
+	void * image;
+
+	image = uefi_alloc_and_decompress_file(buf, &file_size, UEFI_RAMDISK_ALIGN, &uefi_ramdisk_progress);
+	if (!image)
+	{
+		printk("uefi_ramdisk: alloc and read failed\n");
+		return fatal_signal_pending(current) ? -EINTR : -1;
+	}
+
+	printk("uefi_ramdisk: %s %zu bytes", buf, file_size);
+	if (uefi_ramdisk_register(image, file_size) < 0)
+		return -1;
 
 	return count;
 }
 
 
+// the file being loaded, how many bytes have been read and its size
 static ssize_t show(struct kobject * kobj, struct kobj_attribute * attr, char * buf)
 {
-	printk("uefi_ramdisk: show %llx\n", (uint64_t) buf);
-	return -1;
+	return uefi_progress_show(&uefi_ramdisk_progress, buf);
 }
 
 static struct kobj_attribute uefi_ramdisk_attr
 	= __ATTR(ramdisk, 0600, show, store);
 
+
+// The firmware doesn't promise that AllocatePages() returns zeros,
+// so the blank disk has to be cleared, but that is one pass over
+// memory instead of dd writing a file full of zeros and then
+// reading it back into the UEFI memory.
+#define UEFI_RAMDISK_ZERO_CHUNK		(4 << 20)
+
+static int uefi_ramdisk_zero(void * image, size_t size)
+{
+	size_t pos = 0;
+	void * mapped;
+
+	while (pos < size)
+	{
+		const size_t len = min_t(size_t, UEFI_RAMDISK_ZERO_CHUNK, size - pos);
+
+		if (fatal_signal_pending(current))
+			return -EINTR;
+
+		mapped = memremap((phys_addr_t) image + pos, len, MEMREMAP_WB);
+		if (!mapped)
+			return -ENOMEM;
+
+		memset(mapped, 0, len);
+		memunmap(mapped);
+
+		pos += len;
+		WRITE_ONCE(uefi_ramdisk_progress.done, pos);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+// The same table as `fdisk` n, p, 1, default, default, t, b:
+// one W95 FAT32 partition from 1 MiB to the end of the disk.
+static int uefi_ramdisk_mbr(void * image, size_t size)
+{
+	const uint32_t start = 2048;
+	const uint64_t sectors = size / 512;
+	uint8_t * mbr;
+	uint8_t * part;
+	uint32_t len;
+
+	if (sectors <= start || sectors > 0xFFFFFFFF)
+		return -EINVAL;
+	len = sectors - start;
+
+	mbr = memremap((phys_addr_t) image, 512, MEMREMAP_WB);
+	if (!mbr)
+		return -ENOMEM;
+
+	// CHS fields are all "use the LBA" values
+	part = mbr + 446;
+	part[0] = 0x00; // not bootable
+	part[1] = 0xFE; part[2] = 0xFF; part[3] = 0xFF;
+	part[4] = 0x0B; // W95 FAT32
+	part[5] = 0xFE; part[6] = 0xFF; part[7] = 0xFF;
+	put_unaligned_le32(start, &part[8]);
+	put_unaligned_le32(len, &part[12]);
+
+	mbr[510] = 0x55;
+	mbr[511] = 0xAA;
+
+	memunmap(mbr);
+	return 0;
+}
+
+// echo 64M mbr > /sys/firmware/efi/ramdisk_create
+static ssize_t create_store(struct kobject * kobj, struct kobj_attribute *attr, const char * buf, size_t count)
+{
+	char * end;
+	const size_t size = PAGE_ALIGN(memparse(buf, &end));
+	const bool mbr = strncmp(skip_spaces(end), "mbr", 3) == 0;
+	void * image;
+	int rc;
+
+	if (size == 0)
+		return -EINVAL;
+
+	strlcpy(uefi_ramdisk_progress.filename, "blank", sizeof(uefi_ramdisk_progress.filename));
+	WRITE_ONCE(uefi_ramdisk_progress.size, size);
+	WRITE_ONCE(uefi_ramdisk_progress.done, 0);
+
+	image = uefi_alloc_aligned(size, UEFI_RAMDISK_ALIGN);
+	if (!image)
+	{
+		printk("uefi_ramdisk: could not allocate %zu bytes\n", size);
+		return -ENOMEM;
+	}
+
+	rc = uefi_ramdisk_zero(image, size);
+	if (rc == 0 && mbr)
+		rc = uefi_ramdisk_mbr(image, size);
+	if (rc < 0)
+	{
+		printk("uefi_ramdisk: blank disk failed %d\n", rc);
+		uefi_free(image);
+		return rc;
+	}
+
+	printk("uefi_ramdisk: blank %zu bytes%s", size, mbr ? " with mbr" : "");
+	rc = uefi_ramdisk_register(image, size);
+	if (rc < 0)
+		return rc;
+
+	return count;
+}
+
+static struct kobj_attribute uefi_ramdisk_create_attr
+	= __ATTR(ramdisk_create, 0200, NULL, create_store);
+
+
+// /dev/uefi_ramdisk takes the disk image itself, which avoids the
+// copy into a tmpfs file when it is coming from the network or a pipe.
+// The ramdisk is registered when the last writer closes the device.
+static int uefi_ramdisk_open(struct inode * inode, struct file * file)
+{
+	uefi_stream_t * stream;
+
+	if ((file->f_flags & O_ACCMODE) != O_WRONLY)
+		return -EINVAL;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return -ENOMEM;
+
+	uefi_stream_init(stream, UEFI_RAMDISK_ALIGN, 0, &uefi_ramdisk_progress);
+	file->private_data = stream;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t uefi_ramdisk_write(struct file * file, const char __user * buf, size_t len, loff_t * off)
+{
+	return uefi_stream_write(file->private_data, buf, len);
+}
+
+// flush is the only place that close() can report an error
+static int uefi_ramdisk_flush(struct file * file, fl_owner_t id)
+{
+	uefi_stream_t * stream = file->private_data;
+	size_t size;
+	void * image;
+
+	if (file_count(file) != 1)
+		return 0;
+
+	// a write that failed left a hole, and a killed writer might
+	// not have finished, so neither image can be trusted
+	if (stream->error || uefi_stream_killed())
+	{
+		const int rc = stream->error ? stream->error : -EINTR;
+		printk("uefi_ramdisk: discarding /dev/uefi_ramdisk after %zu bytes\n", stream->size);
+		uefi_stream_free(stream);
+		return rc;
+	}
+
+	image = uefi_stream_finish(stream, &size);
+	if (!image)
+		return 0;
+
+	printk("uefi_ramdisk: /dev/uefi_ramdisk %zu bytes", size);
+	return uefi_ramdisk_register(image, size);
+}
+
+static int uefi_ramdisk_release(struct inode * inode, struct file * file)
+{
+	uefi_stream_t * stream = file->private_data;
+
+	uefi_stream_free(stream);
+	kfree(stream);
+
+	return 0;
+}
+
+static const struct file_operations uefi_ramdisk_fops = {
+	.owner		= THIS_MODULE,
+	.open		= uefi_ramdisk_open,
+	.write		= uefi_ramdisk_write,
+	.flush		= uefi_ramdisk_flush,
+	.release	= uefi_ramdisk_release,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice uefi_ramdisk_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "uefi_ramdisk",
+	.fops		= &uefi_ramdisk_fops,
+	.mode		= 0600,
+};
+
 int uefi_ramdisk_init(void)
 {
 	// efi_kobj is the global for /sys/firmware/efi
@@ -67,6 +299,21 @@ int uefi_ramdisk_init(void)
 	}
 
 	printk("uefi_ramdisk: created /sys/firmware/efi/ramdisk\n");
+
+	status = sysfs_create_file(efi_kobj, &uefi_ramdisk_create_attr.attr);
+	if (status < 0)
+		printk("uefi_ramdisk: unable to create /sys/firmware/efi/ramdisk_create: rc=%d\n", status);
+
+	status = misc_register(&uefi_ramdisk_dev);
+	if (status < 0)
+		printk("uefi_ramdisk: unable to create /dev/uefi_ramdisk: rc=%d\n", status);
+
 	return 0;
 }
 
+void uefi_ramdisk_exit(void)
+{
+	// the ramdisks themselves stay, but the device has to go
+	misc_deregister(&uefi_ramdisk_dev);
+}
+
@@ -1,6 +1,15 @@
 #ifndef _uefi_ramdisk_h_
 #define _uefi_ramdisk_h_
 
+#include <linux/mmzone.h>
+
+#ifdef CONFIG_UEFIBLOCK_DAX
+// DAX requires that the RAM disk can be mapped with memremap_pages()
+#define UEFI_RAMDISK_ALIGN	(PAGES_PER_SUBSECTION << PAGE_SHIFT)
+#else
+#define UEFI_RAMDISK_ALIGN	0
+#endif
+
 typedef struct _EFI_RAM_DISK_PROTOCOL  EFI_RAM_DISK_PROTOCOL;
 
 typedef
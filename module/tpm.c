@@ -34,6 +34,10 @@ typedef struct {
 
 static struct platform_device * pdev;
 
+// TPM2_DURATION_LONG_LONG from the TPM driver's private tpm.h, which
+// is how long key generation and the like can legitimately take.
+#define UEFI_TPM_TIMEOUT_MS	300000
+
 static int tpm_response_len(const uint8_t * buf)
 {
         /* size of the data received in the TPM2_RESPONSE_HEADER struct */
@@ -49,12 +53,15 @@ static int uefi_tpm_send(struct tpm_chip * chip, u8 *buf, size_t len)
 	int status;
 	//printk("uefi tpm send %zu\n", len);
 
-	uefi_memory_map_add();
+	// the firmware lock also keeps recv() away from the buffer
+	status = uefi_firmware_enter(&flags);
+	if (status < 0)
+		return status;
 
-	spin_lock_irqsave(&priv->lock, flags);
+	spin_lock(&priv->lock);
 	memset(priv->recv_buf, 0xCC, sizeof(priv->recv_buf));
 
-	status = priv->uefi_tpm->SubmitCommand(
+	status = uefi_call_timeout("SubmitCommand", UEFI_TPM_TIMEOUT_MS, priv->uefi_tpm->SubmitCommand,
 		priv->uefi_tpm,
 		len,
 		buf,
@@ -64,7 +71,8 @@ static int uefi_tpm_send(struct tpm_chip * chip, u8 *buf, size_t len)
 
 	//print_hex_dump(KERN_INFO, "recv data", DUMP_PREFIX_OFFSET, 16, 1, priv->recv_buf, tpm_response_len(priv->recv_buf), true);
 
-	spin_unlock_irqrestore(&priv->lock, flags);
+	spin_unlock(&priv->lock);
+	uefi_firmware_exit(flags);
 
 	if (status != 0)
 	{
@@ -134,30 +142,37 @@ static void *uefi_tpm2_bios_measurements_start(struct seq_file *m, loff_t *pos)
 
 	EFI_PHYSICAL_ADDRESS eventlog_phys, eventlog_end;
 	BOOLEAN eventlog_truncated;
-	size_t size, prev_size;
+	size_t size = 0, prev_size;
+	unsigned long flags;
 	int status;
 
-	uefi_memory_map_add();
+	if (uefi_firmware_enter(&flags) < 0)
+		goto end;
 
-	status = priv->uefi_tpm->GetEventLog(
+	status = uefi_call("GetEventLog", priv->uefi_tpm->GetEventLog,
 		priv->uefi_tpm,
 		EFI_TCG2_EVENT_LOG_FORMAT_TCG_2,
 		&eventlog_phys,
 		&eventlog_end,
 		&eventlog_truncated
 	);
-	if (status != 0)
-	{
-		printk("%s: get eventlog failed: %d\n", name, status);
-		goto end;
-	}
 
 	// this is some massive onzin: the eventlog end is *NOT*
 	// the size of the eventlog, but a pointer to the last entry
 	// so finding the  *actual* size requires parsing that entry
 	// to figure out what is there.
-	size = __calc_tpm2_event_size((void*) eventlog_end, (void*) eventlog_phys, false);
-	size += eventlog_end - eventlog_phys;
+	if (status == 0)
+	{
+		size = __calc_tpm2_event_size((void*) eventlog_end, (void*) eventlog_phys, false);
+		size += eventlog_end - eventlog_phys;
+	}
+
+	uefi_firmware_exit(flags);
+	if (status != 0)
+	{
+		printk("%s: get eventlog failed: %d\n", name, status);
+		goto end;
+	}
 
 	prev_size = log->bios_event_log_end - log->bios_event_log;
 
@@ -178,10 +193,17 @@ static void *uefi_tpm2_bios_measurements_start(struct seq_file *m, loff_t *pos)
 	// free the old copy
 	kfree(log->bios_event_log);
 
-	// we have the UEFI physical memory mapped 1:1, so
-	// we can use physical address directly here for the copy
-	log->bios_event_log = kmemdup((void*) eventlog_phys, size, GFP_KERNEL);
-	log->bios_event_log_end = log->bios_event_log + size;
+	// UEFI has the physical memory mapped 1:1, so the physical
+	// address can be used directly for the copy out of it
+	log->bios_event_log = kmalloc(size, GFP_KERNEL);
+	if (log->bios_event_log
+	&&  uefi_copy_from(log->bios_event_log, (void*) eventlog_phys, size) < 0)
+	{
+		kfree(log->bios_event_log);
+		log->bios_event_log = NULL;
+	}
+
+	log->bios_event_log_end = log->bios_event_log ? log->bios_event_log + size : NULL;
 
 	// pass the call to the original method, regardless of what happens
 end:
@@ -210,6 +232,7 @@ int uefi_tpm_init(void)
 	uefi_tpm_t * priv;
 	struct tpm_chip * chip;
 	EFI_TCG2_BOOT_SERVICE_CAPABILITY caps = { .Size = sizeof(caps) };
+	unsigned long flags;
 	int status;
 
 	pdev = platform_device_register_simple("tpm_uefi", -1, NULL, 0);
@@ -223,7 +246,11 @@ int uefi_tpm_init(void)
 		return 0;
 	}
 
-	status = priv->uefi_tpm->GetCapability(priv->uefi_tpm, &caps);
+	if (uefi_firmware_enter(&flags) < 0)
+		return -1;
+
+	status = uefi_call("GetCapability", priv->uefi_tpm->GetCapability, priv->uefi_tpm, &caps);
+	uefi_firmware_exit(flags);
 	if (status != 0)
 		printk("uefi tpm: get capability failed: %d\n", status);
 
@@ -0,0 +1,50 @@
+/* UEFI firmware call tracepoints
+ *
+ * Every call made with uefi_call() fires one of these when it returns,
+ * so `perf trace -e uefidev:uefi_call` or the ftrace events directory
+ * shows which firmware method is slow and who called it.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uefidev
+
+#if !defined(_UEFIDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UEFIDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(uefi_call,
+	TP_PROTO(const char * method, const char * func, const void * caller, u64 ns, unsigned long status),
+	TP_ARGS(method, func, caller, ns, status),
+
+	TP_STRUCT__entry(
+		__string(method, method)
+		__string(func, func)
+		__field(const void *, caller)
+		__field(u64, ns)
+		__field(unsigned long, status)
+	),
+
+	TP_fast_assign(
+		__assign_str(method, method);
+		__assign_str(func, func);
+		__entry->caller = caller;
+		__entry->ns = ns;
+		__entry->status = status;
+	),
+
+	TP_printk("%s from %s (%pS) %llu ns status=%lx",
+		__get_str(method),
+		__get_str(func),
+		__entry->caller,
+		__entry->ns,
+		__entry->status
+	)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>